@@ -16,3 +16,26 @@ INCLUDE_DIR = $(PROJECT_ROOT)/include
 CFLAGS = -Os -Wall -Wextra -std=gnu99
 CFLAGS += -ffunction-sections -fdata-sections
 LDFLAGS = -Wl,--gc-sections
+
+# FatFs build profiles (FF_PROFILE in ffconf.h): a project sets FATFS_PROFILE
+# before including common.mk and links -l$(FATFS_LIB) (and -l$(SDLOG_LIB)), it
+# is compiled with the same FF_PROFILE as the libraries since the FatFs
+# structures depend on it
+FATFS_PROFILE_tiny       = 1
+FATFS_PROFILE_standard   = 2
+FATFS_PROFILE_throughput = 3
+FATFS_PROFILE ?= standard
+FATFS_LIB = fatfs_$(FATFS_PROFILE)_$(MCU)
+SDLOG_LIB = sdlog_$(FATFS_PROFILE)_$(MCU)
+CFLAGS += -DFF_PROFILE=$(FATFS_PROFILE_$(FATFS_PROFILE))
+
+# SPI backend: SPI_BACKEND=mspim uses a USART in SPI master mode instead of the
+# SPI port. spi and sdcard are then built as libspi_mspim_<mcu>.a and
+# libsdcard_mspim_<mcu>.a: a project links -l$(SDCARD_LIB) -l$(SPI_LIB) so it
+# never mixes the two backends (the SPDR build of sdcard reads SPDR itself)
+ifeq ($(SPI_BACKEND),mspim)
+SPI_SUFFIX = _mspim
+CFLAGS += -DSPI_USE_MSPIM
+endif
+SPI_LIB = spi$(SPI_SUFFIX)_$(MCU)
+SDCARD_LIB = sdcard$(SPI_SUFFIX)_$(MCU)
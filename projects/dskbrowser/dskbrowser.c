@@ -28,17 +28,34 @@
 #define FLEX_DIR_OFFSET   16
 #define FLEX_DIR_LENGTH   24
 
-#define MAX_FILES 100
-#define FILENAME_LEN 32
+/* Catalogue of the disk images: an index file on the card, paged through a
+ * small RAM window so the number of images is limited by the card only */
+#define INDEX_FILE  "DSKINDEX.DAT"
+#define INDEX_MAGIC "DSKIDX1"
+#define PAGE_SIZE   10  /* images per menu page (24 bytes each) */
+
+/* Fast seek cluster link map: 2 DWORDs per fragment + 2 */
+#define CLMT_STATIC 8   /* up to 3 fragments without heap */
+#define CLMT_MAX    256 /* up to 127 fragments (1KB of heap), more falls back to FAT walks */
+#define FILENAME_LEN 16  /* 8.3 names, FF_USE_LFN is 0 */
 #define BUFFER_SIZE 256
 
-/* File list structure */
+/* Catalogue record, also the index file record: 24 bytes without padding on
+ * the AVR and on the host, so a card indexed by one is read by the other */
 typedef struct {
     char filename[FILENAME_LEN];
-    FSIZE_t size;
-    int sector_count;
+    uint32_t size;
+    uint32_t sclust;    /* start cluster, 0 when unknown */
 } DiskFile;
 
+/* First record of the index file */
+typedef struct {
+    char magic[8];
+    uint32_t count;     /* number of image records that follow */
+    uint32_t check;     /* signature of the root directory images */
+    uint32_t reserved[2];
+} DiskIndexHeader;
+
 /* FLEX structures (simplified from your code) */
 typedef struct {
     uint8_t track;
@@ -67,13 +84,17 @@ typedef struct {
 } FlexDirEntry;
 
 /* Global variables */
-static DiskFile disk_files[MAX_FILES];
-static int file_count = 0;
+static DiskFile page[PAGE_SIZE];
+static uint32_t file_count = 0;
+static uint8_t index_ok = 0;    /* 0: no index file (read only card), page from the directory */
 static FIL current_disk;
 static FlexSIR sir_info;
-static uint8_t sector_buffer[BUFFER_SIZE];
 static int current_block = 0;
 static int max_blocks = 0;
+#if FF_USE_FASTSEEK
+static DWORD clmt_static[CLMT_STATIC];
+static DWORD *clmt_heap = NULL;
+#endif
 
 #if !FF_FS_READONLY && !FF_FS_NORTC
 DWORD get_fattime (void)
@@ -94,32 +115,55 @@ DWORD get_fattime (void)
 
 
 /*
- * dump function
+ * Print one hex dump line of up to 16 bytes
  */
-void dump(uint8_t *buffer, size_t size) {
-    uint32_t i, a, lsize;
+void dump_line(const uint8_t *data, uint32_t address, uint8_t size) {
+    uint8_t i;
     int c;
     
-    for (a = 0;;) {
-        printf("%08lX: ", a);
-        lsize = (size >= 16) ? 16 : size;
-        for (i = 0; i < lsize; i++)
-            printf("%02X ", buffer[a + i]);
-        for (i = lsize; i < 16; i++)
-            printf("   ");
-        printf("  |");
-        for (i = 0; i < lsize; i++) {
-            c = buffer[a + i];
-            printf("%c", ((c < 0x20) || (c > 126)) ? '.' : c);
-        }
-        for (i = lsize; i < 16; i++)
-            printf(" ");
-        a += lsize;
-        size -= lsize;
-        printf("|\n");
-        if (size <= 0)
-            return;
+    printf("%08lX: ", (unsigned long)address);
+    for (i = 0; i < size; i++)
+        printf("%02X ", data[i]);
+    for (i = size; i < 16; i++)
+        printf("   ");
+    printf("  |");
+    for (i = 0; i < size; i++) {
+        c = data[i];
+        printf("%c", ((c < 0x20) || (c > 126)) ? '.' : c);
     }
+    for (i = size; i < 16; i++)
+        printf(" ");
+    printf("|\n");
+}
+
+/*
+ * f_forward() stream functions: FatFs hands them the data in its sector
+ * buffer, so a block or a whole image goes to the UART without being copied
+ * to a local buffer first. Called with 0 bytes to check that the stream is
+ * ready. Returns: the number of bytes consumed
+ */
+static uint32_t forward_address;
+
+UINT forward_raw(const BYTE *data, UINT size) {
+    if (size == 0)
+        return 1;
+    uart_write_block(data, size);
+    return size;
+}
+
+UINT forward_hex(const BYTE *data, UINT size) {
+    UINT done;
+    
+    if (size == 0)
+        return 1;
+    /* whole lines only: f_forward() calls again with the rest of the sector */
+    if (size >= 16)
+        size &= ~15U;
+    for (done = 0; done < size; done += 16) {
+        dump_line(data + done, forward_address, (size - done >= 16) ? 16 : size - done);
+        forward_address += 16;
+    }
+    return size;
 }
 
 /*
@@ -157,6 +201,49 @@ uint32_t calculate_block_position(const char* filename, int block_num) {
     return position;
 }
 
+#if FF_USE_FASTSEEK
+/*
+ * Release the cluster link map table, before closing the image
+ */
+void fastseek_close(FIL *fp) {
+    fp->cltbl = NULL;
+    free(clmt_heap);
+    clmt_heap = NULL;
+}
+
+/*
+ * Build the cluster link map table of an open image (fast seek)
+ * every f_lseek() then finds its cluster in the table instead of following the
+ * FAT chain from the start of the file. The table is sized to the image
+ * fragmentation: a static table for a contiguous image, the heap otherwise.
+ */
+void fastseek_open(FIL *fp) {
+    FRESULT res;
+    DWORD needed;
+    
+    clmt_static[0] = CLMT_STATIC;
+    fp->cltbl = clmt_static;
+    res = f_lseek(fp, CREATE_LINKMAP);
+    if (res == FR_NOT_ENOUGH_CORE) {
+        needed = clmt_static[0]; /* size required, returned by FatFs */
+        if (needed <= CLMT_MAX && (clmt_heap = malloc(needed * sizeof(DWORD))) != NULL) {
+            clmt_heap[0] = needed;
+            fp->cltbl = clmt_heap;
+            res = f_lseek(fp, CREATE_LINKMAP);
+        }
+    }
+    if (res != FR_OK) {
+        fastseek_close(fp);
+        printf("Fast seek disabled (%d)\n", res);
+        return;
+    }
+    printf("Fast seek: %lu fragment(s)\n", (unsigned long)(fp->cltbl[0] - 1) / 2);
+}
+#else
+#define fastseek_open(fp)
+#define fastseek_close(fp)
+#endif
+
 /*
  * Read a 256-byte block from disk image
  */
@@ -186,6 +273,56 @@ int read_disk_block(FIL *fp, const char* filename, int block_num, uint8_t *buffe
     return bytes_read;
 }
 
+/*
+ * Hex dump a 256-byte block of the disk image, streamed from the FatFs buffer
+ */
+int show_disk_block(FIL *fp, const char* filename, int block_num) {
+    FRESULT res;
+    UINT bytes_sent;
+    
+    res = f_lseek(fp, calculate_block_position(filename, block_num));
+    if (res != FR_OK) {
+        printf("Seek error: %d\n", res);
+        return -1;
+    }
+    printf("\nBlock %d (0x%08X):\n", block_num, block_num * 256);
+    forward_address = 0;
+    res = f_forward(fp, forward_hex, BUFFER_SIZE, &bytes_sent);
+    if (res != FR_OK) {
+        printf("Read error: %d\n", res);
+        return -1;
+    }
+    return bytes_sent;
+}
+
+/*
+ * Send the whole disk image to the UART, as is or as a hex dump
+ * f_forward() takes a UINT count (16 bits on the AVR): the image goes by 32KB
+ */
+void export_disk(FIL *fp, UINT (*stream)(const BYTE*, UINT)) {
+    FRESULT res;
+    UINT bytes_sent;
+    FSIZE_t remain;
+    
+    res = f_lseek(fp, 0);
+    if (res != FR_OK) {
+        printf("Seek error: %d\n", res);
+        return;
+    }
+    printf("Sending %lu bytes\n", (unsigned long)f_size(fp));
+    forward_address = 0;
+    for (remain = f_size(fp); remain > 0; remain -= bytes_sent) {
+        res = f_forward(fp, stream, (remain > 0x8000) ? 0x8000 : (UINT)remain, &bytes_sent);
+        if (res != FR_OK || bytes_sent == 0)
+            break;
+    }
+    if (res != FR_OK) {
+        printf("\nExport error: %d\n", res);
+        return;
+    }
+    printf("\nSent %lu bytes\n", (unsigned long)(f_size(fp) - remain));
+}
+
 /*
  * Extract FLEX filename from directory entry
  */
@@ -363,75 +500,269 @@ int read_flex_directory(FIL *fp, const char* filename, FlexSIR *sir) {
 }
 
 /*
- * Scan for .DSK and .IMA files
+ * Check the name of a disk image file (.DSK or .IMA)
+ */
+int is_disk_image(const FILINFO *fno) {
+    int len;
+    
+    if (fno->fattrib & AM_DIR)
+        return 0;
+    len = strlen(fno->fname);
+    return (len > 4 &&
+            ((strcmp(&fno->fname[len-4], ".DSK") == 0) ||
+             (strcmp(&fno->fname[len-4], ".dsk") == 0) ||
+             (strcmp(&fno->fname[len-4], ".IMA") == 0) ||
+             (strcmp(&fno->fname[len-4], ".ima") == 0)));
+}
+
+/*
+ * Next disk image of the root directory
+ * Returns: 1 = found, 0 = end of directory, -1 = error
+ */
+int next_disk_image(DIR *dir, FILINFO *fno) {
+    FRESULT res;
+    
+    while (1) {
+        res = f_readdir(dir, fno);
+        if (res != FR_OK)
+            return -1;
+        if (fno->fname[0] == 0)
+            return 0;
+        if (is_disk_image(fno))
+            return 1;
+    }
+}
+
+/*
+ * Signature of the disk images in the root directory (names, sizes, dates)
+ * the index file is rebuilt when it no longer matches
+ * Returns: number of images, -1 = error
  */
-int scan_disk_files(void) {
+long scan_disk_files(uint32_t *check) {
     DIR dir;
     FILINFO fno;
     FRESULT res;
-    int len;
-    
-    file_count = 0;
+    const char *c;
+    long count = 0;
+    int found;
     
+    *check = 0;
     res = f_opendir(&dir, "/");
     if (res != FR_OK) {
         printf("Error opening directory: %d\n", res);
         return -1;
     }
-    
-    while (file_count < MAX_FILES) {
-        res = f_readdir(&dir, &fno);
-        if (res != FR_OK || fno.fname[0] == 0) 
-            break;
-        
-        if (fno.fattrib & AM_DIR) 
-            continue; /* Skip directories */
-        
-        len = strlen(fno.fname);
-        if (len > 4) {
-            if ((strcmp(&fno.fname[len-4], ".DSK") == 0) ||
-                (strcmp(&fno.fname[len-4], ".dsk") == 0) ||
-                (strcmp(&fno.fname[len-4], ".IMA") == 0) ||
-                (strcmp(&fno.fname[len-4], ".ima") == 0)) {
-                
-                strcpy(disk_files[file_count].filename, fno.fname);
-                disk_files[file_count].size = fno.fsize;
-                disk_files[file_count].sector_count = (int)(fno.fsize / 256);
-                file_count++;
-            }
+    while ((found = next_disk_image(&dir, &fno)) > 0) {
+        for (c = fno.fname; *c; c++)
+            *check = ((*check << 5) | (*check >> 27)) ^ (uint8_t)*c;
+        *check = ((*check << 5) | (*check >> 27)) ^ (uint32_t)fno.fsize;
+        *check = ((*check << 5) | (*check >> 27)) ^ (((uint32_t)fno.fdate << 16) | fno.ftime);
+        count++;
+    }
+    f_closedir(&dir);
+    return (found < 0) ? -1 : count;
+}
+
+/*
+ * Write the index file: a header then one record per disk image, in
+ * directory order. The start cluster comes from opening each image.
+ * Returns: 0 = success, non-zero = error
+ */
+FRESULT build_disk_index(uint32_t check) {
+    FIL index, image;
+    DIR dir;
+    FILINFO fno;
+    DiskFile rec;
+    DiskIndexHeader header;
+    FRESULT res;
+    UINT bw;
+    
+    printf("Building catalogue %s...\n", INDEX_FILE);
+    memset(&header, 0, sizeof(header));
+    res = f_open(&index, INDEX_FILE, FA_WRITE | FA_CREATE_ALWAYS);
+    if (res != FR_OK)
+        return res;
+    res = f_write(&index, &header, sizeof(header), &bw);
+    if (res == FR_OK)
+        res = f_opendir(&dir, "/");
+    while (res == FR_OK && next_disk_image(&dir, &fno) > 0) {
+        memset(&rec, 0, sizeof(rec));
+        strcpy(rec.filename, fno.fname);
+        rec.size = fno.fsize;
+        if (f_open(&image, fno.fname, FA_READ) == FR_OK) {
+            rec.sclust = image.obj.sclust;
+            f_close(&image);
         }
+        res = f_write(&index, &rec, sizeof(rec), &bw);
+        if (res == FR_OK && bw != sizeof(rec))
+            res = FR_DENIED;    /* card full */
+        header.count++;
     }
     f_closedir(&dir);
-    return file_count;
+    if (res == FR_OK) {
+        /* the header goes last: an interrupted build leaves an invalid index */
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.check = check;
+        res = f_lseek(&index, 0);
+        if (res == FR_OK)
+            res = f_write(&index, &header, sizeof(header), &bw);
+    }
+    f_close(&index);
+    return res;
 }
 
 /*
- * Display file selection menu
+ * Open the catalogue: use the index file when it matches the root directory,
+ * rebuild it otherwise. A card that cannot hold the index (write protected)
+ * is paged from the directory instead.
+ * param: rebuild = 1 to rebuild the index even when it matches
+ * Returns: number of images, -1 = error
  */
-int show_file_menu(void) {
-    int i, choice;
-    
-    printf("\nDisk Image Files Found:\n");
-    printf("=======================\n");
+long open_catalogue(uint8_t rebuild) {
+    FIL index;
+    DiskIndexHeader header;
+    uint32_t check;
+    long count;
+    UINT br;
+    FRESULT res;
     
-    for (i = 0; i < file_count; i++) {
-        printf("%d. %-20s (%lu bytes, %d sectors)\n",
-               i + 1, disk_files[i].filename, 
-               (unsigned long)disk_files[i].size,
-               disk_files[i].sector_count);
+    count = scan_disk_files(&check);
+    if (count < 0)
+        return -1;
+    index_ok = 0;
+    file_count = count;
+    if (!rebuild && f_open(&index, INDEX_FILE, FA_READ) == FR_OK) {
+        res = f_read(&index, &header, sizeof(header), &br);
+        f_close(&index);
+        if (res == FR_OK && br == sizeof(header) &&
+            memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+            header.check == check && header.count == (uint32_t)count) {
+            index_ok = 1;
+            return count;
+        }
     }
+    res = build_disk_index(check);
+    if (res != FR_OK) {
+        printf("Cannot write %s (%d), reading the directory\n", INDEX_FILE, res);
+        return count;
+    }
+    index_ok = 1;
+    return count;
+}
+
+/*
+ * Load a page of the catalogue in the RAM window
+ * param: first = catalogue number of the first image of the page
+ * Returns: number of images loaded
+ */
+int load_catalogue_page(uint32_t first) {
+    FIL index;
+    DIR dir;
+    FILINFO fno;
+    UINT br;
+    int n = 0;
+    
+    if (index_ok) {
+        if (f_open(&index, INDEX_FILE, FA_READ) != FR_OK)
+            return 0;
+        if (f_lseek(&index, sizeof(DiskIndexHeader) + first * sizeof(DiskFile)) == FR_OK &&
+            f_read(&index, page, sizeof(page), &br) == FR_OK)
+            n = br / sizeof(DiskFile);
+        f_close(&index);
+        return n;
+    }
+    if (f_opendir(&dir, "/") != FR_OK)
+        return 0;
+    while (n < PAGE_SIZE && next_disk_image(&dir, &fno) > 0) {
+        if (first) {
+            first--;
+            continue;
+        }
+        strcpy(page[n].filename, fno.fname);
+        page[n].size = fno.fsize;
+        page[n].sclust = 0;
+        n++;
+    }
+    f_closedir(&dir);
+    return n;
+}
+
+/*
+ * Read a line from the console, without the control characters
+ */
+void read_line(char *line, int size) {
+    int c, len = 0;
     
-    printf("\n0. Exit\n");
-    printf("\nSelect file (0-%d): ", file_count);
-    
-    scanf("%d", &choice);
-    while (getchar() != ENDLINE); /* consume rest of line */
-    
-    if (choice < 0 || choice > file_count) {
-        return -1;
+    while ((c = getchar()) != ENDLINE && c != EOF) {
+        if (c >= 0x20 && len < size - 1)
+            line[len++] = c;
     }
+    line[len] = '\0';
+}
+
+/*
+ * Display the file selection menu, one page of the catalogue at a time
+ * Returns: the selected image (in the page window), NULL to exit (0)
+ */
+const DiskFile *show_file_menu(void) {
+    static uint32_t first = 0;
+    char line[8];
+    int i, n, choice;
     
-    return choice - 1; /* Convert to 0-based index */
+    while (1) {
+        if (first >= file_count)
+            first = 0;
+        n = load_catalogue_page(first);
+        
+        printf("\nDisk Image Files Found: %lu (page %lu/%lu)\n", (unsigned long)file_count,
+               (unsigned long)(first / PAGE_SIZE + 1),
+               (unsigned long)((file_count + PAGE_SIZE - 1) / PAGE_SIZE));
+        printf("=======================\n");
+        
+        for (i = 0; i < n; i++) {
+            printf("%d. %-20s (%lu bytes, %lu sectors)\n",
+                   i + 1, page[i].filename, 
+                   (unsigned long)page[i].size,
+                   (unsigned long)(page[i].size / 256));
+        }
+        
+        printf("\nn. Next page  p. Previous page  r. Rebuild catalogue\n");
+        printf("0. Exit\n");
+        printf("\nSelect file (0-%d): ", n);
+        
+        read_line(line, sizeof(line));
+        switch (line[0]) {
+            case 'n':
+            case 'N':
+                if (first + PAGE_SIZE < file_count)
+                    first += PAGE_SIZE;
+                continue;
+            case 'p':
+            case 'P':
+                if (first >= PAGE_SIZE)
+                    first -= PAGE_SIZE;
+                continue;
+            case 'r':
+            case 'R':
+                open_catalogue(1);
+                continue;
+        }
+        
+        /* only an explicit 0 exits, an empty or invalid line shows the page again */
+        if (line[0] < '0' || line[0] > '9') {
+            if (line[0] != '\0')
+                printf("Invalid choice\n");
+            continue;
+        }
+        choice = atoi(line);
+        if (choice == 0)
+            return NULL;
+        if (choice > n) {
+            printf("Invalid choice\n");
+            continue;
+        }
+        return &page[choice - 1];
+    }
 }
 
 /*
@@ -440,7 +771,6 @@ int show_file_menu(void) {
 void block_browser(const char* filename) {
     char command;
     int block_num;
-    int bytes_read;
     
     printf("\nBlock Browser Commands:\n");
     printf("n - Next block\n");
@@ -498,36 +828,36 @@ void block_browser(const char* filename) {
         }
         
         /* Read and display the block */
-        bytes_read = read_disk_block(&current_disk, filename, current_block, sector_buffer);
-        if (bytes_read > 0) {
-            printf("\nBlock %d (0x%08X):\n", current_block, current_block * 256);
-            dump(sector_buffer, bytes_read);
-        } else {
-            printf("Error reading block %d\n", current_block);
-        }
+        show_disk_block(&current_disk, filename, current_block);
     }
 }
 
 /*
  * Main disk operations menu
  */
-void disk_operations_menu(int file_index) {
+void disk_operations_menu(const DiskFile *file) {
     char command;
     const char* filename;
     FRESULT res;
     
-    filename = disk_files[file_index].filename;
-    max_blocks = disk_files[file_index].sector_count;
+    filename = file->filename;
+    max_blocks = file->size / 256;
     current_block = 0;
     
     printf("\nOpening disk image: %s\n", filename);
     
     /* Open the disk file */
     res = f_open(&current_disk, filename, FA_READ);
+    if (res == FR_OK && file->sclust && current_disk.obj.sclust != file->sclust) {
+        f_close(&current_disk);
+        res = FR_NO_FILE;   /* replaced since the index was built */
+    }
     if (res != FR_OK) {
-        printf("Error opening file: %d\n", res);
+        printf("Error opening file: %d, rebuilding the catalogue\n", res);
+        open_catalogue(1);
         return;
     }
+    fastseek_open(&current_disk);
     
     /* Try to read FLEX SIR */
     if (read_flex_sir(&current_disk, filename, &sir_info) < 0) {
@@ -542,8 +872,10 @@ void disk_operations_menu(int file_index) {
         printf("=====================\n");
         printf("1. Show FLEX directory\n");
         printf("2. Browse blocks (hex dump)\n");
-        printf("3. Return to file selection\n");
-        printf("\nChoice (1-3): ");
+        printf("3. Export image (raw binary)\n");
+        printf("4. Export image (hex dump)\n");
+        printf("5. Return to file selection\n");
+        printf("\nChoice (1-5): ");
         
         command = getchar();
         while (getchar() != ENDLINE); /* consume rest of line */
@@ -558,14 +890,21 @@ void disk_operations_menu(int file_index) {
             case '2':
                 printf("Starting block browser...\n");
                 current_block = 0;
-                if (read_disk_block(&current_disk, filename, current_block, sector_buffer) > 0) {
-                    printf("\nBlock %d (0x%08X):\n", current_block, current_block * 256);
-                    dump(sector_buffer, BUFFER_SIZE);
+                if (show_disk_block(&current_disk, filename, current_block) > 0) {
                     block_browser(filename);
                 }
                 break;
                 
             case '3':
+                export_disk(&current_disk, forward_raw);
+                break;
+                
+            case '4':
+                export_disk(&current_disk, forward_hex);
+                break;
+                
+            case '5':
+                fastseek_close(&current_disk);
                 f_close(&current_disk);
                 return;
                 
@@ -582,7 +921,7 @@ void disk_operations_menu(int file_index) {
 int main(void) {
     FATFS fs;
     FRESULT res;
-    int file_index;
+    const DiskFile *file;
     
     /* Initialize UART console */
     uart_init(BAUD);
@@ -618,7 +957,7 @@ int main(void) {
     
     while (1) {
         /* Scan for disk files */
-        if (scan_disk_files() <= 0) {
+        if (open_catalogue(0) <= 0) {
             printf("No .DSK or .IMA files found\n");
             printf("Waiting 5 seconds before retry...\n");
             _delay_ms(5000);
@@ -626,13 +965,13 @@ int main(void) {
         }
         
         /* Show file selection menu */
-        file_index = show_file_menu();
-        if (file_index < 0) {
+        file = show_file_menu();
+        if (file == NULL) {
             break; /* Exit selected */
         }
         
         /* Open selected file and show operations menu */
-        disk_operations_menu(file_index);
+        disk_operations_menu(file);
     }
     
     f_unmount("");
@@ -0,0 +1,214 @@
+/*
+ * File: diskio-mmap.c
+ * FatFs low level disk I/O for host builds: drive 0 is a FAT image file mapped
+ * with mmap(), so ff.c and the firmware run natively without the card emulator
+ *
+ * disk_read()/disk_write() copy straight between the mapping and the FatFs
+ * buffer: there is no read()/write() call and no intermediate buffer, the page
+ * cache is the medium. The counters give sectors per second of wall time, to
+ * compare FatFs configurations on a whole image archive in seconds
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ff.h"
+#include "diskio.h"
+#include "diskio-mmap.h"
+
+#define DEV_IMAGE     0
+#define SECTOR_SIZE   512
+#define ERASE_BLOCK   32        /* sectors, as reported by the SD card diskio */
+
+static uint8_t *image;
+static size_t image_size;
+static unsigned long image_sectors;
+static int image_fd = -1;
+static int image_writable;
+static DSTATUS status = STA_NOINIT;
+
+static DISKIO_MMAP_STATS stats;
+static struct timespec stats_start;
+
+/*
+ * Map an image file as drive 0
+ * writable: 0 = read only, disk_write() fails with RES_WRPRT
+ * Returns: 0 = success, -1 = error
+ */
+int diskio_mmap_open(const char *path, int writable) {
+  struct stat st;
+
+  diskio_mmap_close();
+  if ((image_fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0)
+    return -1;
+  if (fstat(image_fd, &st) < 0 || st.st_size < SECTOR_SIZE) {
+    diskio_mmap_close();
+    return -1;
+  }
+  image_size = (size_t)st.st_size;
+  image = mmap(NULL, image_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+               MAP_SHARED, image_fd, 0);
+  if (image == MAP_FAILED) {
+    image = NULL;
+    diskio_mmap_close();
+    return -1;
+  }
+  madvise(image, image_size, MADV_WILLNEED);
+  image_sectors  = (unsigned long)(image_size / SECTOR_SIZE);
+  image_writable = writable;
+  status = STA_NOINIT;
+  diskio_mmap_reset_stats();
+  return 0;
+}
+
+void diskio_mmap_close(void) {
+  if (image) {
+    if (image_writable)
+      msync(image, image_size, MS_SYNC);
+    munmap(image, image_size);
+  }
+  if (image_fd >= 0)
+    close(image_fd);
+  image = NULL;
+  image_fd = -1;
+  image_sectors = 0;
+  status = STA_NOINIT;
+}
+
+unsigned long diskio_mmap_sectors(void) {
+  return image_sectors;
+}
+
+void diskio_mmap_reset_stats(void) {
+  memset(&stats, 0, sizeof(stats));
+  clock_gettime(CLOCK_MONOTONIC, &stats_start);
+}
+
+const DISKIO_MMAP_STATS *diskio_mmap_stats(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  stats.ns = (unsigned long long)(now.tv_sec - stats_start.tv_sec) * 1000000000ULL
+           + (unsigned long long)now.tv_nsec - (unsigned long long)stats_start.tv_nsec;
+  return &stats;
+}
+
+/*
+ * Print the counters on a single machine parseable line
+ */
+void diskio_mmap_print_stats(const char *label) {
+  const DISKIO_MMAP_STATS *s = diskio_mmap_stats();
+  double seconds = s->ns ? s->ns / 1e9 : 1e-9;
+
+  printf("%s rd=%llu wr=%llu reads=%lu writes=%lu syncs=%lu time=%llu us"
+         " rd/s=%.0f wr/s=%.0f\n",
+         label, s->sectors_read, s->sectors_written, s->reads, s->writes, s->syncs,
+         s->ns / 1000, s->sectors_read / seconds, s->sectors_written / seconds);
+}
+
+static int in_image(LBA_t sector, UINT count) {
+  return sector < image_sectors && count <= image_sectors - sector;
+}
+
+DSTATUS disk_status (BYTE pdrv) {
+  if (pdrv != DEV_IMAGE || !image)
+    return STA_NOINIT | STA_NODISK;
+  return status;
+}
+
+DSTATUS disk_initialize (BYTE pdrv) {
+  if (pdrv != DEV_IMAGE || !image)
+    return STA_NOINIT | STA_NODISK;
+  status = image_writable ? 0 : STA_PROTECT;
+  return status;
+}
+
+DRESULT disk_read (BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+  if (pdrv != DEV_IMAGE || !count)
+    return RES_PARERR;
+  if (status & STA_NOINIT)
+    return RES_NOTRDY;
+  if (!in_image(sector, count))
+    return RES_PARERR;
+  memcpy(buff, image + (size_t)sector * SECTOR_SIZE, (size_t)count * SECTOR_SIZE);
+  stats.reads++;
+  stats.sectors_read += count;
+  return RES_OK;
+}
+
+#if FF_FS_READONLY == 0
+
+DRESULT disk_write (BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
+  if (pdrv != DEV_IMAGE || !count)
+    return RES_PARERR;
+  if (status & STA_NOINIT)
+    return RES_NOTRDY;
+  if (status & STA_PROTECT)
+    return RES_WRPRT;
+  if (!in_image(sector, count))
+    return RES_PARERR;
+  memcpy(image + (size_t)sector * SECTOR_SIZE, buff, (size_t)count * SECTOR_SIZE);
+  stats.writes++;
+  stats.sectors_written += count;
+  return RES_OK;
+}
+
+#endif
+
+DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void *buff) {
+  LBA_t *range;
+
+  if (pdrv != DEV_IMAGE)
+    return RES_PARERR;
+  if (status & STA_NOINIT)
+    return RES_NOTRDY;
+
+  switch (cmd) {
+  case CTRL_SYNC:       /* the mapping is shared: the page cache already holds the data */
+    stats.syncs++;
+    return RES_OK;
+  case GET_SECTOR_COUNT:
+    *(LBA_t*)buff = image_sectors;
+    return RES_OK;
+  case GET_SECTOR_SIZE:
+    *(WORD*)buff = SECTOR_SIZE;
+    return RES_OK;
+  case GET_BLOCK_SIZE:
+    *(DWORD*)buff = ERASE_BLOCK;
+    return RES_OK;
+  case CTRL_TRIM:       /* reads back as zeros, as an erased SD card */
+    range = (LBA_t*)buff;
+    if (status & STA_PROTECT)
+      return RES_WRPRT;
+    if (range[1] < range[0] || !in_image(range[0], range[1] - range[0] + 1))
+      return RES_PARERR;
+    memset(image + (size_t)range[0] * SECTOR_SIZE, 0,
+           (size_t)(range[1] - range[0] + 1) * SECTOR_SIZE);
+    return RES_OK;
+  case MMC_READ_PARTIAL: {
+    DISK_PARTIAL *p = (DISK_PARTIAL*)buff;
+    const uint8_t *src;
+    UINT i;
+
+    if (!in_image(p->sector, 1) || p->offset + p->count > SECTOR_SIZE)
+      return RES_PARERR;
+    src = image + (size_t)p->sector * SECTOR_SIZE + p->offset;
+    if (p->buff) {
+      memcpy(p->buff, src, p->count);
+    } else {
+      for (i = 0; i < p->count; i++)
+        p->sink(src[i]);
+    }
+    stats.reads++;
+    stats.sectors_read++;
+    return RES_OK;
+  }
+  default:
+    return RES_PARERR;
+  }
+}
@@ -0,0 +1,27 @@
+/*
+ * File: diskio-mmap.h
+ * FatFs diskio backend for host builds serving a FAT image file through mmap()
+ */
+
+#ifndef DISKIO_MMAP_H
+#define DISKIO_MMAP_H
+
+#include <stdint.h>
+
+typedef struct {
+  unsigned long long sectors_read;
+  unsigned long long sectors_written;
+  unsigned long reads;          /* disk_read() calls */
+  unsigned long writes;         /* disk_write() calls */
+  unsigned long syncs;          /* CTRL_SYNC requests */
+  unsigned long long ns;        /* wall time since the last reset */
+} DISKIO_MMAP_STATS;
+
+int         diskio_mmap_open(const char *path, int writable);
+void        diskio_mmap_close(void);
+unsigned long diskio_mmap_sectors(void);
+void        diskio_mmap_reset_stats(void);
+const DISKIO_MMAP_STATS *diskio_mmap_stats(void);
+void        diskio_mmap_print_stats(const char *label);
+
+#endif /* DISKIO_MMAP_H */
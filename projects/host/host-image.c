@@ -0,0 +1,30 @@
+/*
+ * File: host-image.c
+ * opens the emulated card before main() for the firmware built for the host
+ * SDEMU_IMAGE: image file (default sdcard.img)
+ * SDEMU_SDSC:  set to emulate a byte addressed SDSC card
+ * SDEMU_STATS: set to print the bus counters at exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sdemu.h"
+
+static void host_image_close(void) {
+  if (getenv("SDEMU_STATS"))
+    sdemu_print_stats("total");
+  sdemu_close();
+}
+
+__attribute__((constructor))
+static void host_image_open(void) {
+  const char *path = getenv("SDEMU_IMAGE");
+
+  if (!path)
+    path = "sdcard.img";
+  if (sdemu_open(path, getenv("SDEMU_SDSC") ? SDEMU_SDSC : SDEMU_SDHC) < 0) {
+    perror(path);
+    exit(1);
+  }
+  atexit(host_image_close);
+}
@@ -0,0 +1,125 @@
+/*
+ * File: imgbench.c
+ * reads every file of one or more FAT images with FatFs on the mmap diskio
+ * and reports the sectors per second, to compare FatFs configurations
+ * (FATFS_PROFILE, read size) on a disk image archive without hardware
+ *
+ * usage: imgbench [-c CHUNK] [-v] image...
+ *   -c  f_read() size in bytes (default 4096)
+ *   -v  list the files read
+ *
+ * the rate is the wall time of the whole FatFs stack on the host cpu, it is
+ * not a prediction of the AVR throughput: use sdtool for the bus counters
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ff.h"
+#include "diskio.h"
+#include "diskio-mmap.h"
+
+#define MAX_CHUNK   65536
+#define MAX_PATH    256
+
+static uint8_t buffer[MAX_CHUNK];
+static UINT chunk = 4096;
+static int verbose;
+
+static unsigned long files;
+static unsigned long long bytes;
+static unsigned long long total_sectors, total_ns;
+
+DWORD get_fattime(void) {
+  return ((DWORD)(2025 - 1980) << 25) | ((DWORD)1 << 21) | ((DWORD)1 << 16);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: imgbench [-c CHUNK] [-v] image...\n");
+  exit(2);
+}
+
+/*
+ * Reads every file below a directory
+ * param: path of the directory, in a MAX_PATH buffer that is extended in place
+ * Returns: 0 = success, non-zero = error
+ */
+static FRESULT read_tree(char *path) {
+  DIR dir;
+  FILINFO fi;
+  FIL f;
+  UINT br;
+  size_t len = strlen(path);
+  FRESULT res;
+
+  if ((res = f_opendir(&dir, path)) != FR_OK)
+    return res;
+  while ((res = f_readdir(&dir, &fi)) == FR_OK && fi.fname[0]) {
+    if (len + 1 + strlen(fi.fname) >= MAX_PATH)
+      continue;
+    path[len] = '/';
+    strcpy(path + len + 1, fi.fname);
+    if (fi.fattrib & AM_DIR) {
+      res = read_tree(path);
+    } else {
+      if ((res = f_open(&f, path, FA_READ)) == FR_OK) {
+        while ((res = f_read(&f, buffer, chunk, &br)) == FR_OK && br)
+          bytes += br;
+        f_close(&f);
+      }
+      files++;
+      if (verbose)
+        printf("  %-40s %lu\n", path, (unsigned long)fi.fsize);
+    }
+    path[len] = 0;
+    if (res != FR_OK)
+      break;
+  }
+  f_closedir(&dir);
+  return res;
+}
+
+static int bench_image(const char *image) {
+  FATFS fs;
+  char path[MAX_PATH] = "";
+  FRESULT res;
+
+  if (diskio_mmap_open(image, 0) < 0) {
+    perror(image);
+    return 1;
+  }
+  files = 0;
+  bytes = 0;
+  if ((res = f_mount(&fs, "", 1)) == FR_OK)
+    res = read_tree(path);
+  f_mount(NULL, "", 0);
+  printf("%s res=%d files=%lu bytes=%llu ", image, res, files, bytes);
+  diskio_mmap_print_stats("sectors");
+  total_sectors += diskio_mmap_stats()->sectors_read;
+  total_ns      += diskio_mmap_stats()->ns;
+  diskio_mmap_close();
+  return res != FR_OK;
+}
+
+int main(int argc, char **argv) {
+  int i = 1, images, rc = 0;
+
+  while (i < argc && argv[i][0] == '-') {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc)
+      chunk = (UINT)strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "-v"))
+      verbose = 1;
+    else
+      usage();
+    i++;
+  }
+  if (i >= argc || chunk == 0 || chunk > MAX_CHUNK)
+    usage();
+
+  for (images = 0; i < argc; i++, images++)
+    rc |= bench_image(argv[i]);
+  printf("total images=%d chunk=%u rd=%llu time=%llu us rd/s=%.0f\n", images, chunk,
+         total_sectors, total_ns / 1000, total_ns ? total_sectors / (total_ns / 1e9) : 0.0);
+  return rc;
+}
@@ -0,0 +1,10 @@
+/*
+ * host build shim: no interrupts, the emulated clock runs on its own
+ */
+#ifndef HOST_INTERRUPT_H
+#define HOST_INTERRUPT_H
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,9 @@
+/*
+ * host build shim: no AVR registers, the peripherals are emulated
+ */
+#ifndef HOST_IO_H
+#define HOST_IO_H
+
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * host build shim: no interrupts, the atomic blocks run as plain blocks
+ */
+#ifndef HOST_ATOMIC_H
+#define HOST_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for (int atomic_once = 1; atomic_once; atomic_once = 0)
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * host build shim: the delays advance the emulated clock
+ */
+#ifndef HOST_DELAY_H
+#define HOST_DELAY_H
+
+void timer_delay_ms(unsigned int);
+void timer_delay_us(unsigned int);
+
+#define _delay_ms(ms) timer_delay_ms(ms)
+#define _delay_us(us) timer_delay_us(us)
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * File: mmap-image.c
+ * maps the FAT image before main() for the firmware built on diskio-mmap.c
+ * DISKIO_IMAGE: image file (default sdcard.img)
+ * DISKIO_RO:    set to map the image read only
+ * DISKIO_STATS: set to print the sector counters and rates at exit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "diskio-mmap.h"
+
+/* there is no bus to wait for: the firmware delays return at once */
+void timer_delay_ms(unsigned int milliseconds) {
+  (void) milliseconds;
+}
+
+void timer_delay_us(unsigned int microseconds) {
+  (void) microseconds;
+}
+
+static void mmap_image_close(void) {
+  if (getenv("DISKIO_STATS"))
+    diskio_mmap_print_stats("total");
+  diskio_mmap_close();
+}
+
+__attribute__((constructor))
+static void mmap_image_open(void) {
+  const char *path = getenv("DISKIO_IMAGE");
+
+  if (!path)
+    path = "sdcard.img";
+  if (diskio_mmap_open(path, !getenv("DISKIO_RO")) < 0) {
+    perror(path);
+    exit(1);
+  }
+  atexit(mmap_image_close);
+}
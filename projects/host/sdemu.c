@@ -0,0 +1,584 @@
+/*
+ * File: sdemu.c
+ * SD card SPI mode emulator backed by a disk image file
+ *
+ * the emulator models the card side of the SPI protocol byte by byte:
+ * every byte clocked by the host through sdemu_transfer() is fed to the
+ * card state machine and the byte returned is what the card drives on MISO.
+ *
+ * supported commands: CMD0/8/9/12/13/16/17/18/24/25/32/33/38/55/58/59
+ * and ACMD23/41. data tokens, the CMD12 stuff byte, read latency (Nac),
+ * command response latency (Ncr) and busy periods after writes and erases
+ * are emulated so that the driver timeouts and polling loops are exercised.
+ *
+ * all traffic is counted so protocol level optimizations can be compared
+ * exactly: bytes clocked, cpu cycles (bytes * 8 * spi divisor), commands.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sdemu.h"
+
+#define BLOCK_SIZE          512
+#define ACMD41_IDLE_LOOPS     3       /* ACMD41 answers "idle" this many times */
+
+#define R1_READY            0x00
+#define R1_IDLE             0x01
+#define R1_ILLEGAL          0x04
+#define R1_CRC_ERROR        0x08
+#define R1_ADDRESS_ERROR    0x20
+#define R1_PARAM_ERROR      0x40
+
+typedef enum {
+  ST_IDLE,            /* waiting for a command */
+  ST_READ_MULTI,      /* streaming blocks after CMD18 */
+  ST_WRITE_TOKEN,     /* waiting for the start token after CMD24 */
+  ST_WMULTI_TOKEN,    /* waiting for a data / stop token after CMD25 */
+  ST_WRITE_DATA       /* receiving 512 data bytes + crc */
+} sdemu_state_t;
+
+static int           image_fd = -1;
+static unsigned long image_sectors;
+static int           card_type;
+
+static sdemu_state_t state;
+static uint8_t       selected;
+static uint8_t       idle;
+static uint8_t       app_cmd;
+static uint8_t       crc_on;
+static unsigned int  acmd41_loops;
+static uint8_t       divisor = 4;
+
+static uint8_t       cmd_buf[6];
+static uint8_t       cmd_len;
+
+static uint8_t       out_buf[BLOCK_SIZE + 64];
+static unsigned int  out_head, out_tail;
+
+static unsigned long next_block;        /* next block of a CMD18 / CMD25 stream */
+static uint8_t       data_buf[BLOCK_SIZE + 2];
+static unsigned int  data_len;
+static uint8_t       write_multi;
+static unsigned long busy;              /* bytes left in busy state */
+static unsigned long erase_start, erase_end;
+
+static unsigned int  ncr  = 1;          /* bytes before R1 */
+static unsigned int  nac  = 4;          /* bytes before a data token */
+static unsigned int  tbusy = 64;        /* busy bytes after a block write */
+
+static SDEMU_STATS   stats;
+static unsigned long long total_cycles;   /* never reset: the host clock */
+
+static uint8_t crc7(const uint8_t *data, unsigned int len) {
+  uint8_t crc = 0, d, i;
+
+  while (len--) {
+    d = *data++;
+    for (i = 0; i < 8; i++) {
+      crc <<= 1;
+      if ((crc ^ d) & 0x80)
+        crc ^= 0x09;
+      d <<= 1;
+    }
+  }
+  return crc & 0x7F;
+}
+
+static uint16_t crc16(const uint8_t *data, unsigned int len) {
+  uint16_t crc = 0;
+  uint8_t i;
+
+  while (len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static void out_push(uint8_t data) {
+  if (out_head >= out_tail)
+    out_head = out_tail = 0;
+  if (out_tail < sizeof(out_buf))
+    out_buf[out_tail++] = data;
+}
+
+static void out_fill(uint8_t data, unsigned int count) {
+  while (count--)
+    out_push(data);
+}
+
+static void out_reset(void) {
+  out_head = out_tail = 0;
+}
+
+static int out_empty(void) {
+  return out_head >= out_tail;
+}
+
+static void set_bits(uint8_t *reg, unsigned int msb, unsigned int lsb, unsigned long value) {
+  unsigned int bit;
+
+  for (bit = lsb; bit <= msb; bit++, value >>= 1) {
+    if (value & 1)
+      reg[15 - bit / 8] |=  (uint8_t)(1 << (bit % 8));
+    else
+      reg[15 - bit / 8] &= (uint8_t)~(1 << (bit % 8));
+  }
+}
+
+static void build_csd(uint8_t *csd) {
+  memset(csd, 0, 16);
+  if (card_type == SDEMU_SDHC) {
+    set_bits(csd, 127, 126, 1);                     /* CSD_STRUCTURE v2 */
+    set_bits(csd, 69, 48, image_sectors / 1024 - 1);  /* C_SIZE */
+  } else {
+    set_bits(csd, 73, 62, image_sectors / 512 - 1);   /* C_SIZE */
+    set_bits(csd, 49, 47, 7);                       /* C_SIZE_MULT */
+  }
+  set_bits(csd, 119, 112, 0x0E);                    /* TAAC */
+  set_bits(csd, 103, 96, 0x32);                     /* TRAN_SPEED 25MHz */
+  set_bits(csd, 95, 84, 0x5B5);                     /* CCC */
+  set_bits(csd, 83, 80, 9);                         /* READ_BL_LEN */
+  set_bits(csd, 46, 46, 1);                         /* ERASE_BLK_EN */
+  set_bits(csd, 45, 39, 0x7F);                      /* SECTOR_SIZE */
+  set_bits(csd, 25, 22, 9);                         /* WRITE_BL_LEN */
+  csd[15] = (uint8_t)((crc7(csd, 15) << 1) | 1);
+}
+
+static void queue_data_block(const uint8_t *data, unsigned int len) {
+  uint16_t crc = crc16(data, len);
+  unsigned int i;
+
+  out_fill(0xFF, nac);
+  out_push(0xFE);
+  for (i = 0; i < len; i++)
+    out_push(data[i]);
+  out_push((uint8_t)(crc >> 8));
+  out_push((uint8_t)crc);
+}
+
+static int read_block(unsigned long block, uint8_t *data) {
+  if (block >= image_sectors)
+    return -1;
+  if (pread(image_fd, data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != BLOCK_SIZE)
+    return -1;
+  return 0;
+}
+
+static int write_block(unsigned long block, const uint8_t *data) {
+  if (block >= image_sectors)
+    return -1;
+  if (pwrite(image_fd, data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE) != BLOCK_SIZE)
+    return -1;
+  return 0;
+}
+
+/*
+ * Convert a command argument to a block number
+ * Returns: -1 on address error
+ */
+static long arg_to_block(unsigned long arg) {
+  if (card_type == SDEMU_SDSC) {
+    if (arg % BLOCK_SIZE)
+      return -1;
+    arg /= BLOCK_SIZE;
+  }
+  return (long)arg;
+}
+
+static void queue_next_stream_block(void) {
+  uint8_t data[BLOCK_SIZE];
+
+  if (read_block(next_block, data) < 0) {
+    out_fill(0xFF, nac);
+    out_push(0x08);                 /* data error token: out of range */
+    state = ST_IDLE;
+    return;
+  }
+  next_block++;
+  stats.blocks_read++;
+  queue_data_block(data, BLOCK_SIZE);
+}
+
+static void erase_blocks(void) {
+  uint8_t zero[BLOCK_SIZE];
+  unsigned long block;
+
+  memset(zero, 0, sizeof(zero));
+  for (block = erase_start; block <= erase_end && block < image_sectors; block++)
+    write_block(block, zero);
+}
+
+static void execute_command(void) {
+  uint8_t cmd = cmd_buf[0] & 0x3F;
+  unsigned long arg = ((unsigned long)cmd_buf[1] << 24) | ((unsigned long)cmd_buf[2] << 16) |
+                      ((unsigned long)cmd_buf[3] << 8)  | cmd_buf[4];
+  uint8_t is_app = app_cmd;
+  uint8_t r1, reg[16];
+  long block;
+
+  stats.commands++;
+  if (is_app)
+    stats.acmd[cmd]++;
+  else
+    stats.cmd[cmd]++;
+  app_cmd = 0;
+
+  if (cmd == 12 && state == ST_READ_MULTI) {
+    /* CMD12 interrupts the data stream: one stuff byte then R1b */
+    out_reset();
+    out_push(0xA5);
+    out_fill(0xFF, ncr - 1);
+    out_push(R1_READY);
+    out_fill(0x00, 2);
+    state = ST_IDLE;
+    return;
+  }
+  out_reset();
+  if ((crc_on || cmd == 0 || cmd == 8) && crc7(cmd_buf, 5) != (cmd_buf[5] >> 1)) {
+    stats.crc_errors++;
+    out_fill(0xFF, ncr);
+    out_push(R1_CRC_ERROR | idle);
+    return;
+  }
+  r1 = idle;
+  if (idle && cmd != 0 && cmd != 8 && cmd != 55 && cmd != 58 && cmd != 59 && !(is_app && cmd == 41)) {
+    out_fill(0xFF, ncr);
+    out_push(R1_ILLEGAL | R1_IDLE);
+    return;
+  }
+  out_fill(0xFF, ncr);
+  if (is_app) {
+    switch (cmd) {
+    case 41:                          /* SD_SEND_OP_COND */
+      if (card_type == SDEMU_SDHC && !(arg & 0x40000000UL)) {
+        out_push(R1_IDLE);            /* SDHC never leaves idle without HCS */
+      } else if (acmd41_loops++ < ACMD41_IDLE_LOOPS) {
+        out_push(R1_IDLE);
+      } else {
+        idle = 0;
+        out_push(R1_READY);
+      }
+      break;
+    case 23:                          /* SET_WR_BLK_ERASE_COUNT */
+      out_push(r1);
+      break;
+    default:
+      out_push(r1 | R1_ILLEGAL);
+      break;
+    }
+    return;
+  }
+  switch (cmd) {
+  case 0:                             /* GO_IDLE_STATE */
+    idle = 1;
+    crc_on = 0;
+    acmd41_loops = 0;
+    state = ST_IDLE;
+    out_push(R1_IDLE);
+    break;
+  case 8:                             /* SEND_IF_COND */
+    out_push(r1);
+    out_push(0x00);
+    out_push(0x00);
+    out_push(cmd_buf[3] & 0x0F);
+    out_push(cmd_buf[4]);
+    break;
+  case 9:                             /* SEND_CSD */
+    out_push(r1);
+    build_csd(reg);
+    queue_data_block(reg, 16);
+    break;
+  case 12:                            /* STOP_TRANSMISSION outside a transfer */
+    out_push(0xFF);
+    out_push(r1);
+    break;
+  case 13:                            /* SEND_STATUS */
+    out_push(r1);
+    out_push(0x00);
+    break;
+  case 16:                            /* SET_BLOCKLEN */
+    out_push(arg == BLOCK_SIZE ? r1 : r1 | R1_PARAM_ERROR);
+    break;
+  case 17:                            /* READ_SINGLE_BLOCK */
+  case 18:                            /* READ_MULTIPLE_BLOCK */
+    if ((block = arg_to_block(arg)) < 0) {
+      out_push(r1 | R1_ADDRESS_ERROR);
+      break;
+    }
+    if ((unsigned long)block >= image_sectors) {
+      out_push(r1 | R1_PARAM_ERROR);
+      break;
+    }
+    out_push(r1);
+    next_block = (unsigned long)block;
+    if (cmd == 18) {
+      state = ST_READ_MULTI;
+    } else {
+      queue_next_stream_block();
+    }
+    break;
+  case 24:                            /* WRITE_BLOCK */
+  case 25:                            /* WRITE_MULTIPLE_BLOCK */
+    if ((block = arg_to_block(arg)) < 0) {
+      out_push(r1 | R1_ADDRESS_ERROR);
+      break;
+    }
+    if ((unsigned long)block >= image_sectors) {
+      out_push(r1 | R1_PARAM_ERROR);
+      break;
+    }
+    out_push(r1);
+    next_block = (unsigned long)block;
+    write_multi = (cmd == 25);
+    state = write_multi ? ST_WMULTI_TOKEN : ST_WRITE_TOKEN;
+    break;
+  case 32:                            /* ERASE_WR_BLK_START */
+  case 33:                            /* ERASE_WR_BLK_END */
+    if ((block = arg_to_block(arg)) < 0) {
+      out_push(r1 | R1_ADDRESS_ERROR);
+      break;
+    }
+    if (cmd == 32)
+      erase_start = (unsigned long)block;
+    else
+      erase_end = (unsigned long)block;
+    out_push(r1);
+    break;
+  case 38:                            /* ERASE */
+    out_push(r1);
+    erase_blocks();
+    busy = tbusy + (erase_end - erase_start) / 64;
+    break;
+  case 55:                            /* APP_CMD */
+    app_cmd = 1;
+    out_push(r1);
+    break;
+  case 58:                            /* READ_OCR */
+    out_push(r1);
+    out_push((idle ? 0x00 : 0x80) | (card_type == SDEMU_SDHC ? 0x40 : 0x00));
+    out_push(0xFF);
+    out_push(0x80);
+    out_push(0x00);
+    break;
+  case 59:                            /* CRC_ON_OFF */
+    crc_on = arg & 1;
+    out_push(r1);
+    break;
+  default:
+    out_push(r1 | R1_ILLEGAL);
+    break;
+  }
+}
+
+/*
+ * Feed one byte received by the card while a command may be sent
+ */
+static void parse_command_byte(uint8_t mosi) {
+  if (cmd_len == 0) {
+    if ((mosi & 0xC0) != 0x40)
+      return;
+  }
+  cmd_buf[cmd_len++] = mosi;
+  if (cmd_len == 6) {
+    cmd_len = 0;
+    execute_command();
+  }
+}
+
+static void write_data_byte(uint8_t mosi) {
+  uint16_t crc;
+  uint8_t response;
+
+  data_buf[data_len++] = mosi;
+  if (data_len < BLOCK_SIZE + 2)
+    return;
+  crc = ((uint16_t)data_buf[BLOCK_SIZE] << 8) | data_buf[BLOCK_SIZE + 1];
+  if (crc_on && crc != crc16(data_buf, BLOCK_SIZE)) {
+    stats.crc_errors++;
+    response = 0x0B;
+  } else if (write_block(next_block, data_buf) < 0) {
+    response = 0x0D;
+  } else {
+    response = 0x05;
+    next_block++;
+    stats.blocks_written++;
+  }
+  out_reset();
+  out_push(0xE0 | response);
+  busy = tbusy;
+  state = write_multi ? ST_WMULTI_TOKEN : ST_IDLE;
+}
+
+/*
+ * Clock one byte on the bus
+ * mosi: byte sent by the host
+ * Returns: byte sent by the card
+ */
+uint8_t sdemu_transfer(uint8_t mosi) {
+  uint8_t miso;
+
+  stats.bytes++;
+  stats.cycles += 8UL * divisor;
+  total_cycles += 8UL * divisor;
+  if (!selected) {
+    if (busy && out_empty())
+      busy--;
+    return 0xFF;
+  }
+
+  /* card output for this byte */
+  if (!out_empty()) {
+    miso = out_buf[out_head++];
+  } else if (busy) {
+    busy--;
+    miso = 0x00;
+  } else {
+    miso = 0xFF;
+  }
+
+  /* card input for this byte */
+  switch (state) {
+  case ST_IDLE:
+    if (!busy)
+      parse_command_byte(mosi);
+    break;
+  case ST_READ_MULTI:
+    parse_command_byte(mosi);
+    if (state == ST_READ_MULTI && out_empty())
+      queue_next_stream_block();
+    break;
+  case ST_WRITE_TOKEN:
+    if (mosi == 0xFE) {
+      data_len = 0;
+      state = ST_WRITE_DATA;
+    } else if (mosi != 0xFF) {
+      parse_command_byte(mosi);
+    }
+    break;
+  case ST_WMULTI_TOKEN:
+    if (busy || !out_empty())
+      break;
+    if (mosi == 0xFC) {
+      data_len = 0;
+      state = ST_WRITE_DATA;
+    } else if (mosi == 0xFD) {
+      out_reset();
+      out_push(0xFF);
+      busy = tbusy;
+      state = ST_IDLE;
+    }
+    break;
+  case ST_WRITE_DATA:
+    write_data_byte(mosi);
+    break;
+  }
+  return miso;
+}
+
+void sdemu_cs(uint8_t low) {
+  if (low && !selected)
+    stats.selects++;
+  selected = low;
+  if (!low)
+    cmd_len = 0;
+}
+
+void sdemu_set_divisor(uint8_t div) {
+  divisor = div;
+}
+
+/*
+ * Configure card timing in bytes
+ * ncr_bytes: bytes before a command response (1-8)
+ * nac_bytes: bytes before a data token
+ * busy_bytes: busy bytes after a block write
+ */
+void sdemu_set_timing(unsigned int ncr_bytes, unsigned int nac_bytes, unsigned int busy_bytes) {
+  ncr   = ncr_bytes ? ncr_bytes : 1;
+  nac   = nac_bytes;
+  tbusy = busy_bytes;
+}
+
+unsigned long sdemu_sectors(void) {
+  return image_sectors;
+}
+
+/*
+ * Open an image file as the card medium
+ * type: SDEMU_SDHC or SDEMU_SDSC
+ * Returns: 0 = success, -1 = error
+ */
+int sdemu_open(const char *path, int type) {
+  struct stat st;
+
+  if ((image_fd = open(path, O_RDWR)) < 0)
+    return -1;
+  if (fstat(image_fd, &st) < 0) {
+    close(image_fd);
+    image_fd = -1;
+    return -1;
+  }
+  image_sectors = (unsigned long)(st.st_size / BLOCK_SIZE);
+  card_type     = type;
+  state         = ST_IDLE;
+  idle          = 1;
+  selected      = 0;
+  sdemu_reset_stats();
+  return 0;
+}
+
+void sdemu_close(void) {
+  if (image_fd >= 0)
+    close(image_fd);
+  image_fd = -1;
+}
+
+void sdemu_reset_stats(void) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+const SDEMU_STATS *sdemu_stats(void) {
+  return &stats;
+}
+
+/*
+ * Print the counters on a single machine parseable line
+ */
+void sdemu_print_stats(const char *label) {
+  unsigned int i;
+
+  printf("%s bytes=%lu cycles=%lu commands=%lu selects=%lu rd=%lu wr=%lu crcerr=%lu",
+         label, stats.bytes, stats.cycles, stats.commands, stats.selects,
+         stats.blocks_read, stats.blocks_written, stats.crc_errors);
+  for (i = 0; i < 64; i++) {
+    if (stats.cmd[i])
+      printf(" CMD%u=%lu", i, stats.cmd[i]);
+    if (stats.acmd[i])
+      printf(" ACMD%u=%lu", i, stats.acmd[i]);
+  }
+  printf("\n");
+}
+
+/*
+ * CPU cycles spent on the bus since the start, used as the host clock
+ */
+unsigned long long sdemu_cycles(void) {
+  return total_cycles;
+}
+
+/*
+ * Advance the host clock without bus traffic (delays)
+ */
+void sdemu_idle(unsigned long long cycles) {
+  unsigned long long bytes = cycles / (8UL * divisor);
+
+  total_cycles += cycles;
+  /* the card keeps programming while the host does something else */
+  busy = (busy > bytes) ? busy - bytes : 0;
+}
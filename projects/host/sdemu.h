@@ -0,0 +1,39 @@
+/*
+ * File: sdemu.h
+ * SD card SPI mode emulator backed by a disk image file
+ */
+
+#ifndef SDEMU_H
+#define SDEMU_H
+
+#include <stdint.h>
+
+#define SDEMU_SDHC       0    /* block addressed card (CCS = 1) */
+#define SDEMU_SDSC       1    /* byte addressed card  (CCS = 0) */
+
+typedef struct {
+  unsigned long bytes;         /* bytes clocked on the bus */
+  unsigned long cycles;        /* cpu cycles spent clocking (bytes * 8 * divisor) */
+  unsigned long commands;      /* commands received */
+  unsigned long cmd[64];       /* commands received by index (ACMDs are not split) */
+  unsigned long acmd[64];      /* application commands received by index */
+  unsigned long selects;       /* CS low transitions */
+  unsigned long blocks_read;   /* data blocks sent to the host */
+  unsigned long blocks_written;/* data blocks accepted from the host */
+  unsigned long crc_errors;    /* command or data crc errors detected */
+} SDEMU_STATS;
+
+int      sdemu_open(const char *, int);
+void     sdemu_close(void);
+void     sdemu_cs(uint8_t);
+uint8_t  sdemu_transfer(uint8_t);
+void     sdemu_set_divisor(uint8_t);
+void     sdemu_set_timing(unsigned int, unsigned int, unsigned int);
+unsigned long sdemu_sectors(void);
+void     sdemu_reset_stats(void);
+const SDEMU_STATS *sdemu_stats(void);
+void     sdemu_print_stats(const char *);
+unsigned long long sdemu_cycles(void);
+void     sdemu_idle(unsigned long long);
+
+#endif /* SDEMU_H */
@@ -0,0 +1,482 @@
+/*
+ * File: sdtool.c
+ * runs the sdcard, fatfs and spi libraries on the host against an emulated card
+ *
+ * usage: sdtool [-c] [-s] image command [args]
+ *   -c  enable the CRC checks (CMD59)
+ *   -s  emulate a byte addressed SDSC card
+ *
+ * every command prints its result and the bus counters of the emulator
+ * (bytes clocked, cpu cycles, commands) so a change in the libraries can be
+ * measured without hardware
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sdcard.h>
+#include <sdlog.h>
+#include <timer.h>
+#include "ff.h"
+#include "diskio.h"
+#include "sdemu.h"
+
+#define MAX_SECTORS   64
+
+static uint8_t buffer[MAX_SECTORS * 512];
+
+DWORD get_fattime(void) {
+  return ((DWORD)(2025 - 1980) << 25) | ((DWORD)1 << 21) | ((DWORD)1 << 16);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+	  "usage: sdtool [-c] [-s] image command [args]\n"
+	  "  create MB               create a blank image\n"
+	  "  info                    initialize the card and show its geometry\n"
+	  "  reinit                  initialize the card again (warm re-init)\n"
+	  "  read LBA COUNT          read sectors\n"
+	  "  write LBA COUNT         write a pattern, sync and verify it\n"
+	  "  partial LBA OFFSET LEN  read part of a sector (MMC_READ_PARTIAL)\n"
+	  "  trim LBA COUNT          erase sectors (CTRL_TRIM)\n"
+	  "  mkfs [FILES]            format FAT and create FILES test files\n"
+	  "  ls [FILE [SIZE]]        list the root, read FILE by SIZE bytes\n"
+	  "  walk                    seek and read the middle of every file\n"
+	  "  expand KB               allocate a contiguous file (f_expand)\n"
+	  "  put FILE [NAME]         copy a host file to the card root\n"
+	  "  log KB [RECORD [US]]    log KB with sdlog, RECORD bytes every US us, verify\n");
+  exit(2);
+}
+
+static unsigned long arg(int argc, char **argv, int index) {
+  if (index >= argc)
+    usage();
+  return strtoul(argv[index], NULL, 0);
+}
+
+/*
+ * Creates a zero filled image
+ * param: path, size in megabytes
+ * Returns: 0 = success, non-zero = error
+ */
+static int create_image(const char *path, unsigned long megabytes) {
+  FILE *f = fopen(path, "wb");
+
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  if (fseek(f, (long)(megabytes * 1024 * 1024) - 1, SEEK_SET) || fputc(0, f) == EOF) {
+    perror(path);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+  printf("created %s %lu MB\n", path, megabytes);
+  return 0;
+}
+
+static void print_cache_stats(void) {
+  DISK_CACHE_STATS cs;
+
+  if (disk_ioctl(0, MMC_GET_CACHE_STATS, &cs) == RES_OK)
+    printf("cache hits=%lu misses=%lu writebacks=%lu\n",
+	   (unsigned long)cs.hits, (unsigned long)cs.misses, (unsigned long)cs.writebacks);
+}
+
+static int cmd_read(unsigned long lba, unsigned long count) {
+  unsigned int i;
+  DRESULT res;
+
+  if (count == 0 || count > MAX_SECTORS)
+    return 1;
+  sdemu_reset_stats();
+  res = disk_read(0, buffer, lba, count);
+  printf("read=%d\n", res);
+  sdemu_print_stats("read");
+  for (i = 0; i < 16; i++)
+    printf("%02X ", buffer[i]);
+  printf("\n");
+  return res != RES_OK;
+}
+
+static int cmd_write(unsigned long lba, unsigned long count) {
+  unsigned long i;
+  DRESULT res;
+
+  if (count == 0 || count > MAX_SECTORS)
+    return 1;
+  for (i = 0; i < count * 512; i++)
+    buffer[i] = (uint8_t)(i * 7 + lba);
+  sdemu_reset_stats();
+  res = disk_write(0, buffer, lba, count);
+  printf("write=%d\n", res);
+  sdemu_print_stats("write");
+  res |= disk_ioctl(0, CTRL_SYNC, NULL);
+  printf("sync=%d\n", res);
+  sdemu_print_stats("write+sync");
+  memset(buffer, 0, sizeof(buffer));
+  res |= disk_read(0, buffer, lba, count);
+  for (i = 0; i < count * 512; i++) {
+    if (buffer[i] != (uint8_t)(i * 7 + lba)) {
+      printf("verify failed at byte %lu\n", i);
+      return 1;
+    }
+  }
+  printf("verify=%d\n", res);
+  return res != RES_OK;
+}
+
+static int cmd_partial(unsigned long lba, unsigned int offset, unsigned int len) {
+  static uint8_t full[512];
+  DISK_PARTIAL p;
+  DRESULT res;
+
+  if (offset + len > 512)
+    return 1;
+  if (disk_read(0, full, lba, 1) != RES_OK)
+    return 1;
+  p.sector = lba;
+  p.offset = offset;
+  p.count = len;
+  p.buff = buffer;
+  p.sink = NULL;
+  sdemu_reset_stats();
+  res = disk_ioctl(0, MMC_READ_PARTIAL, &p);
+  printf("partial=%d\n", res);
+  sdemu_print_stats("partial");
+  if (memcmp(buffer, full + offset, len)) {
+    printf("verify failed\n");
+    return 1;
+  }
+  return res != RES_OK;
+}
+
+static int cmd_trim(unsigned long lba, unsigned long count) {
+  LBA_t range[2];
+  unsigned long i;
+  DRESULT res;
+
+  if (count == 0)
+    return 1;
+  memset(buffer, 0x5A, 512);
+  for (i = 0; i < count; i++)
+    disk_write(0, buffer, lba + i, 1);
+  disk_ioctl(0, CTRL_SYNC, NULL);
+  range[0] = lba;
+  range[1] = lba + count - 1;
+  sdemu_reset_stats();
+  res = disk_ioctl(0, CTRL_TRIM, range);
+  printf("trim=%d\n", res);
+  sdemu_print_stats("trim");
+  for (i = 0; i < count; i++) {
+    disk_read(0, buffer, lba + i, 1);
+    if (buffer[0] || buffer[511]) {
+      printf("sector %lu not erased\n", lba + i);
+      return 1;
+    }
+  }
+  return res != RES_OK;
+}
+
+#if FF_USE_MKFS
+/*
+ * Formats the card and writes test files: FILEnn.DAT holds 8 KB of the byte nn
+ */
+static int cmd_mkfs(unsigned int files) {
+  static BYTE work[4096];
+  MKFS_PARM opt = { FM_FAT, 0, 0, 0, 0 };
+  FATFS fs;
+  FIL f;
+  UINT bw;
+  char name[16];
+  unsigned int i, n;
+  FRESULT res;
+
+  res = f_mkfs("", &opt, work, sizeof(work));
+  printf("mkfs=%d\n", res);
+  if (res != FR_OK)
+    return 1;
+  f_mount(&fs, "", 1);
+  for (i = 0; i < files && res == FR_OK; i++) {
+    sprintf(name, "FILE%02u.DAT", i % 100);
+    memset(buffer, (int)i, 512);
+    res = f_open(&f, name, FA_WRITE | FA_CREATE_ALWAYS);
+    for (n = 0; n < 16 && res == FR_OK; n++)
+      res = f_write(&f, buffer, 512, &bw);
+    f_close(&f);
+  }
+  f_mount(NULL, "", 0);
+  disk_ioctl(0, CTRL_SYNC, NULL);
+  printf("files=%u res=%d\n", i, res);
+  return res != FR_OK;
+}
+#else
+static int cmd_mkfs(unsigned int files) {
+  printf("f_mkfs() is not in this FatFs profile\n");
+  return 1;
+}
+#endif
+
+static int cmd_ls(const char *name, unsigned int chunk) {
+  FATFS fs;
+  DIR dir;
+  FILINFO fi;
+  FIL f;
+  UINT br;
+  unsigned long total = 0;
+  FRESULT res;
+
+  if ((res = f_mount(&fs, "", 1)) != FR_OK) {
+    printf("mount=%d\n", res);
+    return 1;
+  }
+  f_opendir(&dir, "/");
+  while (f_readdir(&dir, &fi) == FR_OK && fi.fname[0])
+    printf("%-12s %lu\n", fi.fname, (unsigned long)fi.fsize);
+  f_closedir(&dir);
+  if (!name)
+    return 0;
+  if (chunk == 0 || chunk > sizeof(buffer))
+    chunk = 4096;
+  sdemu_reset_stats();
+  if ((res = f_open(&f, name, FA_READ)) != FR_OK) {
+    printf("open=%d\n", res);
+    return 1;
+  }
+  while (f_read(&f, buffer, chunk, &br) == FR_OK && br)
+    total += br;
+  f_close(&f);
+  printf("read %lu bytes by %u\n", total, chunk);
+  sdemu_print_stats("f_read");
+  return 0;
+}
+
+/*
+ * Reads 100 bytes from the middle of every root file, checking the content
+ * written by mkfs: the access pattern of a catalogue browser
+ */
+static int cmd_walk(void) {
+  FATFS fs;
+  DIR dir;
+  FILINFO fi;
+  FIL f;
+  UINT br;
+  unsigned long files = 0, bad = 0;
+  FRESULT res;
+
+  if ((res = f_mount(&fs, "", 1)) != FR_OK) {
+    printf("mount=%d\n", res);
+    return 1;
+  }
+  sdemu_reset_stats();
+  f_opendir(&dir, "/");
+  while (f_readdir(&dir, &fi) == FR_OK && fi.fname[0]) {
+    f_open(&f, fi.fname, FA_READ);
+    f_lseek(&f, fi.fsize / 2 + 17);
+    f_read(&f, buffer, 100, &br);
+    if (br != 100 || buffer[0] != (uint8_t)atoi(fi.fname + 4))
+      bad++;
+    f_close(&f);
+    files++;
+  }
+  f_closedir(&dir);
+  printf("files=%lu bad=%lu\n", files, bad);
+  sdemu_print_stats("walk");
+  print_cache_stats();
+  return bad != 0;
+}
+
+static int cmd_expand(unsigned long kilobytes) {
+  FATFS fs;
+  FIL f;
+  FRESULT res;
+
+  if ((res = f_mount(&fs, "", 1)) != FR_OK) {
+    printf("mount=%d\n", res);
+    return 1;
+  }
+  sdemu_reset_stats();
+  res = f_open(&f, "EXPAND.BIN", FA_WRITE | FA_CREATE_ALWAYS);
+  if (res == FR_OK)
+    res = f_expand(&f, kilobytes * 1024, 1);
+  printf("expand=%d size=%lu\n", res, (unsigned long)f_size(&f));
+  f_close(&f);
+  f_unlink("EXPAND.BIN");
+  sdemu_print_stats("expand+unlink");
+  return res != FR_OK;
+}
+
+static int cmd_put(const char *path, const char *name) {
+  FATFS fs;
+  FIL f;
+  FILE *in;
+  UINT bw;
+  size_t n;
+  unsigned long total = 0;
+  FRESULT res;
+
+  if (!name) {
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+  }
+  if (!(in = fopen(path, "rb"))) {
+    perror(path);
+    return 1;
+  }
+  if ((res = f_mount(&fs, "", 1)) == FR_OK)
+    res = f_open(&f, name, FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK) {
+    printf("open=%d\n", res);
+    fclose(in);
+    return 1;
+  }
+  sdemu_reset_stats();
+  while (res == FR_OK && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    res = f_write(&f, buffer, (UINT)n, &bw);
+    total += bw;
+  }
+  f_close(&f);
+  f_mount(NULL, "", 0);
+  disk_ioctl(0, CTRL_SYNC, NULL);
+  fclose(in);
+  printf("put %s %lu bytes res=%d\n", name, total, res);
+  sdemu_print_stats("f_write");
+  return res != FR_OK;
+}
+
+/*
+ * Logs a counter pattern through sdlog in a file pre-allocated to KB, leaving
+ * the last sector partial, then reads it back with f_read()
+ * a record is produced every interval us (emulated time, the card programs
+ * meanwhile), sdlog_task() is called in between as a main loop would
+ */
+static int cmd_log(unsigned long kilobytes, unsigned int record, unsigned int interval) {
+  FATFS fs;
+  FIL f;
+  SDLOG_STATS st;
+  UINT br;
+  unsigned long size, i, n;
+  uint8_t res;
+
+  if (kilobytes == 0 || record == 0 || record > sizeof(buffer))
+    return 1;
+  size = kilobytes * 1024 - 100;
+  if (f_mount(&fs, "", 1) != FR_OK)
+    return 1;
+  sdemu_reset_stats();
+  res = sdlog_open("LOG.BIN", kilobytes * 1024);
+  printf("open=%u\n", res);
+  sdemu_print_stats("sdlog_open");
+  if (res != SDLOG_SUCCESS)
+    return 1;
+  sdemu_reset_stats();
+  for (i = 0; i < size && res == SDLOG_SUCCESS; i += n) {
+    n = (size - i < record) ? size - i : record;
+    for (unsigned long k = 0; k < n; k++)
+      buffer[k] = (uint8_t)((i + k) * 7 + ((i + k) >> 9));
+    res = sdlog_write(buffer, (uint16_t)n);
+    if (res == SDLOG_SUCCESS || res == SDLOG_ER_OVERRUN)
+      res = sdlog_task();
+    timer_delay_us(interval);
+  }
+  sdemu_print_stats("sdlog_write");
+  sdemu_reset_stats();
+  res |= sdlog_close();
+  sdlog_stats(&st);
+  printf("close=%u bytes=%lu dropped=%lu sectors=%lu\n", res,
+	 (unsigned long)st.bytes, (unsigned long)st.dropped, (unsigned long)st.sectors);
+  sdemu_print_stats("sdlog_close");
+  if (f_open(&f, "LOG.BIN", FA_READ) != FR_OK)
+    return 1;
+  printf("size=%lu max_wait=%u ms\n", (unsigned long)f_size(&f), st.max_wait_ms);
+  if (st.dropped) {
+    f_close(&f);
+    return 1;
+  }
+  for (i = 0; f_read(&f, buffer, 512, &br) == FR_OK && br; ) {
+    for (n = 0; n < br; n++, i++)
+      if (buffer[n] != (uint8_t)(i * 7 + (i >> 9))) {
+	printf("verify failed at byte %lu\n", i);
+	f_close(&f);
+	return 1;
+      }
+  }
+  f_close(&f);
+  printf("verify=%d\n", i != size);
+  return res != SDLOG_SUCCESS || i != size;
+}
+
+int main(int argc, char **argv) {
+  int type = SDEMU_SDHC;
+  uint8_t crc = 0;
+  const char *image, *cmd;
+  DSTATUS st;
+  int i = 1, rc;
+
+  while (i < argc && argv[i][0] == '-') {
+    if (!strcmp(argv[i], "-c"))      crc = 1;
+    else if (!strcmp(argv[i], "-s")) type = SDEMU_SDSC;
+    else usage();
+    i++;
+  }
+  if (i + 2 > argc)
+    usage();
+  image = argv[i++];
+  cmd = argv[i++];
+
+  if (!strcmp(cmd, "create"))
+    return create_image(image, arg(argc, argv, i));
+
+  if (sdemu_open(image, type) < 0) {
+    perror(image);
+    return 1;
+  }
+  st = disk_initialize(0);
+  printf("init=%d type=%u clock=%u kHz sectors=%lu time=%u ms\n",
+	 st, sd_type(), sd_clock_khz(), sd_sector_count(), sd_init_time());
+  sdemu_print_stats("init");
+  if (st & STA_NOINIT) {
+    sdemu_close();
+    return 1;
+  }
+  if (crc)
+    printf("crc=%u\n", sd_set_crc(1));
+
+  if (!strcmp(cmd, "info"))
+    rc = 0;
+  else if (!strcmp(cmd, "reinit")) {
+    sdemu_reset_stats();
+    st = disk_initialize(0);
+    printf("reinit=%d time=%u ms\n", st, sd_init_time());
+    sdemu_print_stats("reinit");
+    rc = (st & STA_NOINIT) != 0;
+  }
+  else if (!strcmp(cmd, "read"))
+    rc = cmd_read(arg(argc, argv, i), arg(argc, argv, i + 1));
+  else if (!strcmp(cmd, "write"))
+    rc = cmd_write(arg(argc, argv, i), arg(argc, argv, i + 1));
+  else if (!strcmp(cmd, "partial"))
+    rc = cmd_partial(arg(argc, argv, i), arg(argc, argv, i + 1), arg(argc, argv, i + 2));
+  else if (!strcmp(cmd, "trim"))
+    rc = cmd_trim(arg(argc, argv, i), arg(argc, argv, i + 1));
+  else if (!strcmp(cmd, "log"))
+    rc = cmd_log(arg(argc, argv, i), i + 1 < argc ? arg(argc, argv, i + 1) : 64,
+		 i + 2 < argc ? arg(argc, argv, i + 2) : 0);
+  else if (!strcmp(cmd, "mkfs"))
+    rc = cmd_mkfs(i < argc ? arg(argc, argv, i) : 0);
+  else if (!strcmp(cmd, "ls"))
+    rc = cmd_ls(i < argc ? argv[i] : NULL, i + 1 < argc ? arg(argc, argv, i + 1) : 0);
+  else if (!strcmp(cmd, "walk"))
+    rc = cmd_walk();
+  else if (!strcmp(cmd, "expand"))
+    rc = cmd_expand(arg(argc, argv, i));
+  else if (!strcmp(cmd, "put") && i < argc)
+    rc = cmd_put(argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+  else
+    usage();
+
+  sdemu_close();
+  return rc;
+}
@@ -0,0 +1,175 @@
+/*
+ * File: spi-host.c
+ * spi library implementation for host builds, the bus is wired to the SD card emulator
+ * the divisor follows the AVR SPI rules (2 to 128, rounded up) so the cycle counts
+ * of the emulator match the real bus
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spi.h>
+#include "sdemu.h"
+
+#define F_CPU_KHZ   (F_CPU / 1000)
+
+static uint8_t spi_divisor = 128;
+static uint8_t spi_pending;
+static uint8_t spi_enabled;
+static uint8_t spi_config = SPI_MODE0 | SPI_MSB_FIRST;
+static SPI_DEVICE *spi_bus_owner;
+
+void spi_cs_low(void) {
+  sdemu_cs(1);
+}
+
+void spi_cs_high(void) {
+  sdemu_cs(0);
+}
+
+static uint8_t spi_hw_divisor(uint8_t divisor) {
+  if (divisor > 64)      return 128;
+  else if (divisor > 32) return 64;
+  else if (divisor > 16) return 32;
+  else if (divisor > 8)  return 16;
+  else if (divisor > 4)  return 8;
+  else if (divisor > 2)  return 4;
+  else                   return 2;
+}
+
+void spi_set_divisor(uint8_t divisor) {
+  spi_divisor = spi_hw_divisor(divisor);
+  sdemu_set_divisor(spi_divisor);
+}
+
+uint8_t spi_get_divisor(void) {
+  return spi_divisor;
+}
+
+void spi_set_mode(uint8_t cpol, uint8_t cpha) {
+  spi_config = (spi_config & SPI_LSB_FIRST) | (cpol ? 0x02 : 0) | (cpha ? 0x01 : 0);
+}
+
+void spi_set_bit_order(uint8_t order) {
+  spi_config = (spi_config & 0x03) | (order & SPI_LSB_FIRST);
+}
+
+uint8_t spi_calculate_divisor(uint16_t frequency_khz) {
+  uint32_t divisor;
+
+  if (frequency_khz == 0)
+    return 255;
+  divisor = (F_CPU_KHZ + frequency_khz - 1) / frequency_khz;
+  if (divisor > 255) divisor = 255;
+  if (divisor < 2) divisor = 2;
+  return (uint8_t)divisor;
+}
+
+void spi_set_frequency_khz(uint16_t frequency) {
+  spi_set_divisor(spi_calculate_divisor(frequency));
+}
+
+uint16_t spi_get_frequency_khz(void) {
+  return (uint16_t)(F_CPU_KHZ / spi_divisor);
+}
+
+void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
+  spi_config = SPI_MSB_FIRST;
+  spi_enabled = 1;
+  spi_set_mode(cpol, cpha);
+  spi_set_divisor(divisor);
+  spi_cs_high();
+}
+
+uint8_t spi_transfer(uint8_t data) {
+  return sdemu_transfer(data);
+}
+
+void spi_begin_transfer(uint8_t data) {
+  spi_pending = sdemu_transfer(data);
+}
+
+uint8_t spi_end_transfer(void) {
+  return spi_pending;
+}
+
+void spi_write_block(const uint8_t *data, uint16_t len) {
+  while (len--)
+    sdemu_transfer(*data++);
+}
+
+void spi_read_block(uint8_t *data, uint16_t len) {
+  while (len--)
+    *data++ = sdemu_transfer(0xFF);
+}
+
+void spi_fill(uint8_t value, uint16_t len) {
+  while (len--)
+    sdemu_transfer(value);
+}
+
+/*
+ * the device registry works as on the AVR: only the board CS (cs_port NULL)
+ * reaches the emulated card, other CS lines are plain variables
+ */
+void spi_register(SPI_DEVICE *dev, volatile uint8_t *cs_ddr, volatile uint8_t *cs_port,
+                  uint8_t cs_pin, uint8_t mode, uint8_t order, uint16_t max_khz) {
+  dev->cs_port = cs_port;
+  dev->cs_mask = 1 << cs_pin;
+  dev->config = (mode & 0x03) | (order & SPI_LSB_FIRST);
+  dev->divisor = spi_hw_divisor(spi_calculate_divisor(max_khz));
+  dev->release = NULL;
+  if (!spi_enabled)
+    spi_init(128, 0, 0);
+  if (cs_port) {
+    *cs_port |= dev->cs_mask;
+    *cs_ddr |= dev->cs_mask;
+  }
+}
+
+void spi_set_device_khz(SPI_DEVICE *dev, uint16_t max_khz) {
+  dev->divisor = spi_hw_divisor(spi_calculate_divisor(max_khz));
+  if (spi_bus_owner == dev && dev->divisor != spi_divisor)
+    spi_set_divisor(dev->divisor);
+}
+
+uint16_t spi_get_device_khz(const SPI_DEVICE *dev) {
+  return (uint16_t)(F_CPU_KHZ / dev->divisor);
+}
+
+uint8_t spi_acquire(SPI_DEVICE *dev) {
+  if (spi_bus_owner != NULL && spi_bus_owner != dev && spi_bus_owner->release != NULL)
+    spi_bus_owner->release();
+  if (spi_bus_owner != NULL && spi_bus_owner != dev)
+    return SPI_ER_BUSY;
+  spi_bus_owner = dev;
+  if (dev->config != spi_config) {
+    spi_set_mode(dev->config & 0x02, dev->config & 0x01);
+    spi_set_bit_order(dev->config & SPI_LSB_FIRST);
+  }
+  if (dev->divisor != spi_divisor)
+    spi_set_divisor(dev->divisor);
+  return SPI_SUCCESS;
+}
+
+uint8_t spi_select(SPI_DEVICE *dev) {
+  if (spi_acquire(dev) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
+  if (dev->cs_port)
+    *dev->cs_port &= ~dev->cs_mask;
+  else
+    spi_cs_low();
+  return SPI_SUCCESS;
+}
+
+void spi_deselect(SPI_DEVICE *dev) {
+  if (dev->cs_port)
+    *dev->cs_port |= dev->cs_mask;
+  else
+    spi_cs_high();
+  if (spi_bus_owner == dev)
+    spi_bus_owner = NULL;
+}
+
+SPI_DEVICE *spi_owner(void) {
+  return spi_bus_owner;
+}
@@ -0,0 +1,86 @@
+/*
+ * File: timer-host.c
+ * timer library implementation for host builds
+ * there is no cpu emulation: the clock counts the cycles spent clocking the
+ * emulated SPI bus plus the delays, so it measures the bus time only
+ */
+
+#include <stdint.h>
+#include <timer.h>
+#include "sdemu.h"
+
+#define CYCLES_PER_US  (F_CPU / 1000000UL)
+#define CYCLES_PER_MS  (F_CPU / 1000UL)
+
+static unsigned long long timer_base;
+static unsigned long long clock_base;
+static uint8_t clock_running;
+static uint8_t timer_running;
+
+void timer_start(void) {
+  timer_base = sdemu_cycles();
+  timer_running = 1;
+}
+
+void timer_stop(void) {
+  timer_running = 0;
+}
+
+uint16_t timer_read(void) {
+  return (uint16_t)(sdemu_cycles() - timer_base);
+}
+
+uint8_t timer_is_running(void) {
+  return timer_running;
+}
+
+uint8_t timer_cpu_speed(void) {
+  return (uint8_t)(F_CPU / 1000000UL);
+}
+
+uint32_t timer_ticks_to_us(unsigned int ticks) {
+  return ticks / CYCLES_PER_US;
+}
+
+uint16_t timer_ticks_to_ms(unsigned int ticks) {
+  return (uint16_t)(ticks / CYCLES_PER_MS);
+}
+
+void timer_delay_ticks(unsigned int ticks) {
+  sdemu_idle(ticks);
+}
+
+void timer_delay_us(unsigned int microseconds) {
+  sdemu_idle((unsigned long long)microseconds * CYCLES_PER_US);
+}
+
+void timer_delay_ms(unsigned int milliseconds) {
+  sdemu_idle((unsigned long long)milliseconds * CYCLES_PER_MS);
+}
+
+uint32_t timer_get_frequency_hz(void) {
+  return F_CPU;
+}
+
+uint32_t timer_get_ticks_per_ms(void) {
+  return CYCLES_PER_MS;
+}
+
+uint16_t timer_get_ticks_per_us(void) {
+  return CYCLES_PER_US;
+}
+
+void timer_clock_start(void) {
+  if (clock_running)
+    return;
+  clock_base = sdemu_cycles();
+  clock_running = 1;
+}
+
+uint32_t timer_millis(void) {
+  return (uint32_t)((sdemu_cycles() - clock_base) / CYCLES_PER_MS);
+}
+
+uint32_t timer_micros(void) {
+  return (uint32_t)((sdemu_cycles() - clock_base) / CYCLES_PER_US);
+}
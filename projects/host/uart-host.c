@@ -0,0 +1,50 @@
+/*
+ * File: uart-host.c
+ * uart-mega library implementation for host builds: the console is stdin/stdout
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <uart-mega.h>
+
+void uart_init(uint32_t baud) {
+  (void) baud;
+  setvbuf(stdout, NULL, _IONBF, 0);
+}
+
+void uart_putc(char c) {
+  putchar(c);
+}
+
+char uart_getc(void) {
+  int c = getchar();
+
+  return (c == EOF) ? 0 : (char)c;
+}
+
+uint8_t uart_available(void) {
+  return 1;
+}
+
+void uart_puts(const char *s) {
+  fputs(s, stdout);
+}
+
+void uart_read_block(uint8_t *buffer, uint8_t len) {
+  while (len--)
+    *buffer++ = (uint8_t)uart_getc();
+}
+
+void uart_write_block(const uint8_t *buffer, uint16_t len) {
+  fwrite(buffer, 1, len, stdout);
+}
+
+void uart_set_echo(uint8_t echo) {
+  (void) echo;
+}
+
+void uart_console() {
+}
+
+void uart_restore() {
+}
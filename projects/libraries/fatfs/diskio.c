@@ -7,18 +7,180 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sdcard.h>
 #include "ff.h"			/* Basic definitions of FatFs */
 #include "diskio.h"		/* Declarations FatFs API */
 
 /* Device mapping */
 #define DEV_SDCARD	    0 	/* Map SD card to physical drive 0 */
-#define SD_INIT_SPEED     200   /* 200 khz */
-#define SD_NORMAL_SPEED 10000   /* 10Mhz if the cpu is fast enough khz */
+#define SYNC_TIMEOUT	  500	/* ms, end of programming of the last sector */
+#define INIT_RETRY	    2	/* sd_init() is bounded in time, a failure retries with a full power-up */
+
+/* Sector cache size, 512 bytes of SRAM per sector, 0 = no cache (make DISK_CACHE_SECTORS=n) */
+#ifndef DISK_CACHE_SECTORS
+#if FF_PROFILE == FF_PROFILE_TINY
+#define DISK_CACHE_SECTORS  0	/* tiny profile: RAM first */
+#elif defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)
+#define DISK_CACHE_SECTORS  8	/* 4KB of the 16KB */
+#elif defined(__AVR_ATmega2560__)
+#define DISK_CACHE_SECTORS  4	/* 2KB of the 8KB */
+#else
+#define DISK_CACHE_SECTORS  0	/* ATmega328P: no room */
+#endif
+#endif
 
 static bool initialized = false;
 static bool protected   = false;
 static bool nodisk      = true;
+static LBA_t next_sector = (LBA_t)-1;	/* sector following the last card read */
+
+#if DISK_CACHE_SECTORS > 0
+
+/*-----------------------------------------------------------------------*/
+/* Sector cache                                                          */
+/*-----------------------------------------------------------------------*/
+/* FF_FS_TINY shares one sector window between the FAT, the directory    */
+/* and the files, the cache keeps the last used sectors so walking a     */
+/* directory while seeking in a file doesn't re-read them every time.    */
+/* Single sector accesses go through the cache (LRU, write-back), multi  */
+/* sector transfers are file data and go straight to the card.           */
+/*-----------------------------------------------------------------------*/
+
+typedef struct {
+  LBA_t sector;
+  bool  valid;
+  bool  dirty;
+  BYTE  data[512];
+} CACHE_LINE;
+
+static CACHE_LINE cache[DISK_CACHE_SECTORS];
+static BYTE cache_lru[DISK_CACHE_SECTORS];	/* line numbers, most recently used first */
+static DISK_CACHE_STATS cache_stats;
+
+static void cache_reset(void) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++) {
+    cache[i].valid = false;
+    cache[i].dirty = false;
+    cache_lru[i] = i;
+  }
+}
+
+/* Move a line at the head of the LRU list */
+static void cache_touch(BYTE line) {
+  BYTE i;
+
+  for (i = 0; cache_lru[i] != line; i++)
+    ;
+  for (; i > 0; i--)
+    cache_lru[i] = cache_lru[i - 1];
+  cache_lru[0] = line;
+}
+
+/* Returns the line holding sector or -1 */
+static int cache_find(LBA_t sector) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return i;
+  return -1;
+}
+
+/* Write a dirty line back to the card */
+static DRESULT cache_flush_line(BYTE line) {
+  if (!cache[line].dirty)
+    return RES_OK;
+  if (sd_write_begin(cache[line].sector, cache[line].data) != SD_SUCCESS)
+    return RES_ERROR;
+  cache[line].dirty = false;
+  cache_stats.writebacks++;
+  return RES_OK;
+}
+
+static DRESULT cache_flush(void) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (cache_flush_line(i) != RES_OK)
+      return RES_ERROR;
+  return RES_OK;
+}
+
+/* Free a line for sector: an unused one (never filled or discarded by CTRL_TRIM) first,
+ * else the least recently used, returns -1 if it can't be written back */
+static int cache_alloc(LBA_t sector) {
+  BYTE line = cache_lru[DISK_CACHE_SECTORS - 1];
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (!cache[i].valid) {
+      line = i;
+      break;
+    }
+  if (cache_flush_line(line) != RES_OK)
+    return -1;
+  cache[line].sector = sector;
+  cache[line].valid  = false;
+  return line;
+}
+
+/* Apply the cached sectors of [sector, sector + count) to a buffer read from the card */
+static void cache_overlay(BYTE *buff, LBA_t sector, UINT count) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (cache[i].dirty && cache[i].sector >= sector && cache[i].sector - sector < count)
+      memcpy(buff + (UINT)(cache[i].sector - sector) * 512, cache[i].data, 512);
+}
+
+/* Drop the cached sectors of [start, end], dirty or not, their content is no longer used */
+static void cache_discard(LBA_t start, LBA_t end) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (cache[i].valid && cache[i].sector >= start && cache[i].sector <= end) {
+      cache[i].valid = false;
+      cache[i].dirty = false;
+    }
+}
+
+/* The card now holds the data of [sector, sector + count): refresh the cached copies */
+static void cache_update(const BYTE *buff, LBA_t sector, UINT count) {
+  BYTE i;
+
+  for (i = 0; i < DISK_CACHE_SECTORS; i++)
+    if (cache[i].valid && cache[i].sector >= sector && cache[i].sector - sector < count) {
+      memcpy(cache[i].data, buff + (UINT)(cache[i].sector - sector) * 512, 512);
+      cache[i].dirty = false;
+    }
+}
+
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Sequential read-ahead                                                 */
+/*-----------------------------------------------------------------------*/
+/* A read starting where the previous one ended goes through an open     */
+/* READ_MULTIPLE_BLOCK transfer: the card keeps streaming and each next  */
+/* sector costs no command. A random single sector uses CMD17, the open  */
+/* transfer is closed by the card library before any other command, and  */
+/* when another SPI device is selected (release hook of the bus).        */
+/*-----------------------------------------------------------------------*/
+
+static DRESULT read_sectors(BYTE *buff, LBA_t sector, UINT count) {
+  if (count == 1 && sector != next_sector) {
+    next_sector = sector + 1;
+    return (sd_read(sector, buff) == SD_SUCCESS) ? RES_OK : RES_ERROR;
+  }
+  for (; count > 0; count--, sector++, buff += 512)
+    if (sd_read_sequential(sector, buff) != SD_SUCCESS)
+      return RES_ERROR;
+  next_sector = sector;
+  return RES_OK;
+}
 
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -45,9 +207,13 @@ DSTATUS disk_initialize (BYTE pdrv) {	/* Physical drive number to identify the d
 
   if (pdrv != DEV_SDCARD) 
     return STA_NOINIT;	                /* Supports only SD card */
-  for (count = 0; count < 10; count++) {
+  for (count = 0; count < INIT_RETRY; count++) {
     res = sd_init();
     if (res == SD_SUCCESS) {
+#if DISK_CACHE_SECTORS > 0
+      cache_reset();		/* the card may have been swapped */
+#endif
+      next_sector = (LBA_t)-1;
       nodisk = false;
       protected = false;
       initialized = true;
@@ -63,20 +229,44 @@ DSTATUS disk_initialize (BYTE pdrv) {	/* Physical drive number to identify the d
 /*-----------------------------------------------------------------------*/
 
 DRESULT disk_read (BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
-  UINT i;
-  
   if (pdrv != DEV_SDCARD) 
     return RES_PARERR;	/* Invalid drive */
   if (!initialized)  
     return RES_NOTRDY;	/* Not initialized */
   if (!count) 
     return RES_PARERR;	/* Invalid parameter */
-  // Read multiple sectors
-  for (i = 0; i < count; i++) {
-    if (sd_read(sector + i, buff + (i * 512)) != SD_SUCCESS) 
-      return RES_ERROR;
+#if DISK_CACHE_SECTORS > 0
+  if (count == 1) {
+    int line = cache_find(sector);
+
+    if (line >= 0) {
+      cache_stats.hits++;
+      cache_touch(line);
+    } else {
+      bool sequential = (sector == next_sector);
+
+      cache_stats.misses++;
+      if ((line = cache_alloc(sector)) < 0)
+	return RES_ERROR;
+      if (read_sectors(cache[line].data, sector, 1) != RES_OK)
+	return RES_ERROR;
+      cache[line].valid = true;
+      // Streamed file data stays at the cold end of the LRU list: it must not
+      // evict the FAT and directory sectors, a FAT miss would break the stream
+      if (!sequential)
+	cache_touch(line);
+    }
+    memcpy(buff, cache[line].data, 512);
+    return RES_OK;
   }
+  // Read multiple sectors in a CMD18 transfer, sectors not yet written back come from the cache
+  if (read_sectors(buff, sector, count) != RES_OK)
+    return RES_ERROR;
+  cache_overlay(buff, sector, count);
   return RES_OK;
+#else
+  return read_sectors(buff, sector, count);
+#endif
 }
 
 /*-----------------------------------------------------------------------*/
@@ -86,20 +276,38 @@ DRESULT disk_read (BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
 #if FF_FS_READONLY == 0
 
 DRESULT disk_write (BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {		
-  UINT i;
-  
   if (pdrv != DEV_SDCARD) 
     return RES_PARERR;	/* Invalid drive */
   if (!initialized) 
     return RES_NOTRDY;	/* Not initialized */
   if (!count) 
     return RES_PARERR;	/* Invalid parameter */
-  // Write multiple sectors
-  for (i = 0; i < count; i++) {
-    if (sd_write(sector + i, (BYTE*)(buff + (i * 512))) != SD_SUCCESS) 
+#if DISK_CACHE_SECTORS > 0
+  // Single sectors stay in the cache until evicted or CTRL_SYNC (write-back)
+  if (count == 1) {
+    int line = cache_find(sector);
+
+    if (line < 0 && (line = cache_alloc(sector)) < 0)
       return RES_ERROR;
+    memcpy(cache[line].data, buff, 512);
+    cache[line].valid = true;
+    cache[line].dirty = true;
+    cache_touch(line);
+    return RES_OK;
   }
+  // Write multiple sectors in a single pre-erased CMD25 transfer
+  if (sd_write_multi(sector, count, (BYTE*)buff) != SD_SUCCESS)
+    return RES_ERROR;
+  cache_update(buff, sector, count);
   return RES_OK;
+#else
+  // Single sectors are written behind: the card programs while FatFs goes on,
+  // the next command (or CTRL_SYNC) waits for the end of programming
+  if (count == 1)
+    return (sd_write_begin(sector, (BYTE*)buff) == SD_SUCCESS) ? RES_OK : RES_ERROR;
+  // Write multiple sectors in a single pre-erased CMD25 transfer
+  return (sd_write_multi(sector, count, (BYTE*)buff) == SD_SUCCESS) ? RES_OK : RES_ERROR;
+#endif
 }
 
 #endif
@@ -119,14 +327,19 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void *buff) {
   res = RES_ERROR;
   switch (cmd) {
   case CTRL_SYNC:	  /* Complete pending write process */
-                          /* For SD cards, write operations are typically synchronous */
-    res = RES_OK;
+    sd_read_stop();	  /* release the card, the data read is already checked */
+#if DISK_CACHE_SECTORS > 0
+    if (cache_flush() != RES_OK)
+      break;
+#endif
+    if (sd_wait_ready(SYNC_TIMEOUT) == SD_SUCCESS)
+      res = RES_OK;
     break;
     
   case GET_SECTOR_COUNT:  /* Get media size */
-    // This would require implementing sd_get_sector_count() in your SD library
-    // For now, return error - FatFS can work without this for basic operations
-    res = RES_ERROR;
+    *(LBA_t*)buff = sd_sector_count();	/* decoded from the CSD by sd_init() */
+    if (*(LBA_t*)buff)
+      res = RES_OK;
     break;
     
   case GET_SECTOR_SIZE:	/* Get sector size */
@@ -138,6 +351,54 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void *buff) {
     *(DWORD*)buff = 32;	/* SD cards typically have 32-sector erase blocks */
     res = RES_OK;
     break;
+
+  case CTRL_TRIM:	  /* Erase a range of sectors no longer used */
+    {
+      LBA_t *range = (LBA_t*)buff;	/* start and end sector (included) */
+#if DISK_CACHE_SECTORS > 0
+      cache_discard(range[0], range[1]);
+#endif
+      if (sd_erase(range[0], range[1]) == SD_SUCCESS)
+	res = RES_OK;
+    }
+    break;
+
+  case MMC_READ_PARTIAL:  /* Read a byte range of a sector */
+    {
+      DISK_PARTIAL *part = (DISK_PARTIAL*)buff;
+#if DISK_CACHE_SECTORS > 0
+      int line = cache_find(part->sector);
+      UINT i;
+
+      if (line >= 0) {
+	if (part->offset + part->count > 512)
+	  break;
+	cache_stats.hits++;
+	if (part->buff)
+	  memcpy(part->buff, cache[line].data + part->offset, part->count);
+	else
+	  for (i = 0; i < part->count; i++)
+	    part->sink(cache[line].data[part->offset + i]);
+	res = RES_OK;
+	break;
+      }
+#endif
+      if (sd_read_stream(part->sector, part->offset, part->count, part->buff, part->sink) == SD_SUCCESS)
+	res = RES_OK;
+    }
+    break;
+
+#if DISK_CACHE_SECTORS > 0
+  case MMC_GET_CACHE_STATS: /* Get the sector cache counters */
+    *(DISK_CACHE_STATS*)buff = cache_stats;
+    res = RES_OK;
+    break;
+
+  case MMC_RESET_CACHE_STATS: /* Clear the sector cache counters */
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    res = RES_OK;
+    break;
+#endif
     
   default:
     res = RES_PARERR;
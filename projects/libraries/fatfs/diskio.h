@@ -61,10 +61,29 @@ DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define MMC_GET_CID			12	/* Get CID */
 #define MMC_GET_OCR			13	/* Get OCR */
 #define MMC_GET_SDSTAT		14	/* Get SD status */
+#define MMC_READ_PARTIAL	15	/* Read a byte range of a sector without a sector buffer */
+#define MMC_GET_CACHE_STATS	16	/* Get the sector cache counters (DISK_CACHE_STATS) */
+#define MMC_RESET_CACHE_STATS	17	/* Clear the sector cache counters */
 #define ISDIO_READ			55	/* Read data form SD iSDIO register */
 #define ISDIO_WRITE			56	/* Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/* Masked write data to SD iSDIO register */
 
+/* Argument of MMC_READ_PARTIAL */
+typedef struct {
+	LBA_t	sector;			/* Sector to read */
+	UINT	offset;			/* Offset of the first byte in the sector */
+	UINT	count;			/* Number of bytes to read (offset + count <= sector size) */
+	BYTE*	buff;			/* Destination buffer, or NULL to use sink */
+	void	(*sink)(BYTE);	/* Called for each byte when buff is NULL */
+} DISK_PARTIAL;
+
+/* Argument of MMC_GET_CACHE_STATS */
+typedef struct {
+	DWORD	hits;			/* Sector reads served from the cache */
+	DWORD	misses;			/* Sector reads that went to the card */
+	DWORD	writebacks;		/* Dirty sectors written back to the card */
+} DISK_CACHE_STATS;
+
 /* ATA/CF specific ioctl command (Not used by FatFs) */
 #define ATA_GET_REV			20	/* Get F/W revision */
 #define ATA_GET_MODEL		21	/* Get model name */
@@ -4,6 +4,28 @@
 
 #define FFCONF_DEF	80386	/* Revision ID */
 
+/*---------------------------------------------------------------------------/
+/ Build Profiles
+/---------------------------------------------------------------------------*/
+
+#define FF_PROFILE_TINY			1
+#define FF_PROFILE_STANDARD		2
+#define FF_PROFILE_THROUGHPUT	3
+
+#ifndef FF_PROFILE
+#define FF_PROFILE		FF_PROFILE_STANDARD
+#endif
+/* This option selects the build profile of libfatfs_<profile>_<mcu>.a, it is set
+/  with -DFF_PROFILE=n by the fatfs Makefile (make PROFILE=name).
+/
+/   1: tiny       - shared sector window, no fast seek, no f_mkfs(), no sector cache.
+/   2: standard   - shared sector window, fast seek, f_mkfs(), f_expand().
+/   3: throughput - private sector buffer in each file object, fast seek, f_mkfs(),
+/                   f_expand().
+/
+/  The size of FIL depends on the profile: a project must be compiled with the
+/  FF_PROFILE of the library it links (FATFS_PROFILE in the project Makefile). */
+
 /*---------------------------------------------------------------------------/
 / Function Configurations
 /---------------------------------------------------------------------------*/
@@ -30,15 +52,15 @@
 /  f_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
 
-#define FF_USE_MKFS		0
+#define FF_USE_MKFS		(FF_PROFILE != FF_PROFILE_TINY)
 /* This option switches f_mkfs(). (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FASTSEEK	0
+#define FF_USE_FASTSEEK	(FF_PROFILE != FF_PROFILE_TINY)
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
+#define FF_USE_EXPAND	1
 /* This option switches f_expand(). (0:Disable or 1:Enable) */
 
 
@@ -52,7 +74,7 @@
 /  (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FORWARD	0
+#define FF_USE_FORWARD	1
 /* This option switches f_forward(). (0:Disable or 1:Enable) */
 
 
@@ -225,7 +247,7 @@
 /  f_fdisk(). 2^32 sectors maximum. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable this feature, also CTRL_TRIM command should be implemented to
 /  the disk_ioctl(). */
@@ -236,7 +258,7 @@
 / System Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_FS_TINY		1
+#define FF_FS_TINY		(FF_PROFILE != FF_PROFILE_THROUGHPUT)
 /* This option switches tiny buffer configuration. (0:Normal or 1:Tiny)
 /  At the tiny configuration, size of file object (FIL) is reduced FF_MAX_SS bytes.
 /  Instead of private sector buffer eliminated from the file object, common sector
@@ -1,29 +1,136 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include "i2c.h"
 
-// Check if we're on a mega (with hardware TWI/I2C)
-#if defined(__AVR_ATmega328P__)  || defined(__AVR_ATmega328__)  || \
-    defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || \
-    defined(__AVR_ATmega168__)   || defined(__AVR_ATmega88__)   || \
-    defined(__AVR_ATmega2560__)  || defined(__AVR_ATmega48__)
-  #define HARDWARE_I2C
+// HARDWARE_I2C (mega with the TWI) is set by i2c.h
+
+// ATtiny25/45/85: the USI in two-wire mode shifts the bytes, SDA and SCL
+// are then fixed on PB0 and PB2 (other pins fall back to bit-banging)
+#if (defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || \
+     defined(__AVR_ATtiny85__)) && I2C_SDA_PIN == PB0 && I2C_SCL_PIN == PB2
+  #define USI_I2C
+#endif
+
+// Bus speed of i2c_init(), 100000 (standard mode) or 400000 (fast mode):
+// -DI2C_SPEED=400000. On the tinies it is also the only speed
+#ifndef I2C_SPEED
+  #define I2C_SPEED 100000UL
+#endif
+
+// A byte, clock stretching included, must be done within I2C_TIMEOUT_MS,
+// else the bus is stuck: the transfer fails and the bus is recovered
+#ifndef I2C_TIMEOUT_MS
+  #define I2C_TIMEOUT_MS 10
+#endif
+#define I2C_LOOPS  ((uint32_t)(F_CPU / 1000UL) * I2C_TIMEOUT_MS / 10)  // about 10 cycles a loop
+
+// Pins of the bus, driven by hand by i2c_recover()
+#if defined(HARDWARE_I2C)
+  #if defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__)
+    #define BUS_PORT   PORTC
+    #define BUS_DDR    DDRC
+    #define BUS_PIN    PINC
+    #define BUS_SDA    (1 << PC1)
+    #define BUS_SCL    (1 << PC0)
+  #elif defined(__AVR_ATmega2560__)
+    #define BUS_PORT   PORTD
+    #define BUS_DDR    DDRD
+    #define BUS_PIN    PIND
+    #define BUS_SDA    (1 << PD1)
+    #define BUS_SCL    (1 << PD0)
+  #else
+    #define BUS_PORT   PORTC
+    #define BUS_DDR    DDRC
+    #define BUS_PIN    PINC
+    #define BUS_SDA    (1 << PC4)
+    #define BUS_SCL    (1 << PC5)
+  #endif
+#else
+  #define BUS_PORT     PORTB
+  #define BUS_DDR      DDRB
+  #define BUS_PIN      PINB
+  #define BUS_SDA      (1 << I2C_SDA_PIN)
+  #define BUS_SCL      (1 << I2C_SCL_PIN)
 #endif
 
 #ifdef HARDWARE_I2C
 
 // Hardware I2C for ATmega
 
+/*
+ * Set the bus clock: SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS)
+ * the smallest prescaler where TWBR fits is taken, for the finest steps, and
+ * TWBR is rounded up: the clock is never faster than asked
+ * freq: in Hz, 100000 (standard), 400000 (fast), 1000000 (fast mode plus)
+ * Returns: 0 = success, I2C_ER_SPEED if freq is out of reach (the nearest clock is set)
+ */
+uint8_t i2c_init_hz(uint32_t freq) {
+    uint32_t twbr = 0;
+    uint8_t twps = 0;
+    uint8_t status = I2C_SUCCESS;
+
+    if (freq && (F_CPU + freq - 1) / freq >= 16) {
+        twbr = ((F_CPU + freq - 1) / freq - 15) / 2;
+        while (twbr > 255 && twps < 3) {
+            twbr = (twbr + 3) / 4;
+            twps++;
+        }
+        if (twbr > 255) {
+            twbr = 255;
+            status = I2C_ER_SPEED;
+        }
+    } else {
+        status = I2C_ER_SPEED;              // F_CPU / 16 is the fastest
+    }
+    TWBR = twbr;
+    TWSR = twps;
+    return status;
+}
+
 void i2c_init(void) {
-    // Set SCL to 100kHz (assuming F_CPU = 16MHz)
-    TWBR = ((F_CPU / 100000UL) - 16) / 2;
-    TWSR = 0; // Prescaler = 1
+    i2c_init_hz(I2C_SPEED);
 }
 
-void i2c_start(void) {
+/*
+ * Wait for the end of the current TWI operation, a stuck bus is recovered
+ * Returns: 0 = success, I2C_ER_TIMEOUT
+ */
+static uint8_t twi_wait(void) {
+    uint32_t loops = I2C_LOOPS;
+
+    while (!(TWCR & (1 << TWINT))) {
+        if (!--loops) {
+            i2c_recover();
+            return I2C_ER_TIMEOUT;
+        }
+    }
+    return I2C_SUCCESS;
+}
+
+/*
+ * Wait for the last STOP to be on the bus
+ */
+static void twi_wait_stop(void) {
+    uint32_t loops = I2C_LOOPS;
+
+    while (TWCR & (1 << TWSTO)) {
+        if (!--loops) {
+            i2c_recover();
+            return;
+        }
+    }
+}
+
+// the byte by byte functions wait for the queued transactions to finish
+uint8_t i2c_start(void) {
+    i2c_wait();
+    twi_wait_stop();
     TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN);
-    while (!(TWCR & (1 << TWINT)));
+    return twi_wait();
 }
 
 void i2c_stop(void) {
@@ -33,7 +140,8 @@ void i2c_stop(void) {
 uint8_t i2c_write(uint8_t data) {
     TWDR = data;
     TWCR = (1 << TWINT) | (1 << TWEN);
-    while (!(TWCR & (1 << TWINT)));
+    if (twi_wait())
+        return 0;
     return (TWSR & 0xF8) == 0x18 || (TWSR & 0xF8) == 0x28 || (TWSR & 0xF8) == 0x40;
 }
 
@@ -43,10 +151,349 @@ uint8_t i2c_read(uint8_t ack) {
     } else {
         TWCR = (1 << TWINT) | (1 << TWEN);
     }
-    while (!(TWCR & (1 << TWINT)));
+    if (twi_wait())
+        return 0xFF;
     return TWDR;
 }
 
+/*
+ * Send a block after the address, stops at the first byte not acknowledged
+ * Returns: 0 = success, I2C_ER_DATA_NACK, I2C_ER_TIMEOUT
+ */
+uint8_t i2c_write_block(const uint8_t *data, uint16_t len) {
+    while (len--) {
+        TWDR = *data++;
+        TWCR = (1 << TWINT) | (1 << TWEN);
+        if (twi_wait())
+            return I2C_ER_TIMEOUT;
+        if ((TWSR & 0xF8) != 0x28)
+            return I2C_ER_DATA_NACK;
+    }
+    return I2C_SUCCESS;
+}
+
+/*
+ * Receive a block after the address, every byte but the last is acknowledged
+ * Returns: 0 = success, I2C_ER_TIMEOUT
+ */
+uint8_t i2c_read_block(uint8_t *data, uint16_t len) {
+    while (len--) {
+        TWCR = len ? (1 << TWINT) | (1 << TWEN) | (1 << TWEA) : (1 << TWINT) | (1 << TWEN);
+        if (twi_wait())
+            return I2C_ER_TIMEOUT;
+        *data++ = TWDR;
+    }
+    return I2C_SUCCESS;
+}
+
+/* Interrupt driven transactions
+ * i2c_submit() queues a transaction, the TWI interrupt runs it byte by byte
+ * and starts the next one (STOP and START in the same TWCR write), so the
+ * main loop only waits when it needs the result. With the interrupts disabled
+ * the transactions only progress in i2c_wait(), which then runs the state machine
+ */
+
+#define TWCR_RUN   ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+
+static I2C_TRANSACTION *queue[I2C_QUEUE_SIZE];
+static volatile uint8_t queue_head;         // running transaction
+static volatile uint8_t queue_count;
+static volatile uint8_t running;            // the interrupt owns the TWI
+static volatile uint8_t events;             // TWI steps, to tell a stuck bus
+static uint8_t phase;                       // of the running transaction
+static uint16_t position;                   // byte of the phase
+
+enum { PHASE_HEADER, PHASE_WRITE, PHASE_READ };
+
+/*
+ * Send the next byte of the write phases, or go on with the read or STOP
+ * Returns: the TWCR value to write
+ */
+static uint8_t twi_next_write(I2C_TRANSACTION *t) {
+    if (phase == PHASE_HEADER) {
+        if (position < t->header_len) {
+            TWDR = t->header[position++];
+            return TWCR_RUN;
+        }
+        phase = PHASE_WRITE;
+        position = 0;
+    }
+    if (position < t->write_len) {
+        TWDR = t->write[position++];
+        return TWCR_RUN;
+    }
+    if (t->read_len) {
+        phase = PHASE_READ;
+        position = 0;
+        return TWCR_RUN | (1 << TWSTA);     // repeated START
+    }
+    return 0;                               // done
+}
+
+/*
+ * Finish the running transaction and start the next one, interrupt context
+ * stop: 1 to send a STOP (0 after an arbitration loss: the bus is not ours)
+ */
+static void twi_complete(uint8_t status, uint8_t stop) {
+    I2C_TRANSACTION *t = queue[queue_head];
+
+    queue_head = (queue_head + 1) % I2C_QUEUE_SIZE;
+    queue_count--;
+    t->status = status;
+    if (t->done)
+        t->done(t);                         // may submit a new transaction
+    phase = PHASE_HEADER;
+    position = 0;
+    if (queue_count) {
+        TWCR = TWCR_RUN | (1 << TWSTA) | (stop ? (1 << TWSTO) : 0);
+    } else {
+        running = 0;
+        TWCR = (1 << TWINT) | (1 << TWEN) | (stop ? (1 << TWSTO) : 0);
+    }
+}
+
+/*
+ * TWI state machine, one step per TWINT
+ */
+static void twi_service(void) {
+    I2C_TRANSACTION *t = queue[queue_head];
+    uint8_t twcr;
+
+    events++;
+    switch (TWSR & 0xF8) {
+    case 0x08:                              // START
+    case 0x10:                              // repeated START
+        if (phase == PHASE_READ || (!t->header_len && !t->write_len && t->read_len)) {
+            phase = PHASE_READ;
+            TWDR = (t->address << 1) | 1;
+        } else {
+            TWDR = t->address << 1;
+        }
+        TWCR = TWCR_RUN;
+        break;
+    case 0x18:                              // SLA+W acknowledged
+    case 0x28:                              // data acknowledged
+        if ((twcr = twi_next_write(t)) != 0)
+            TWCR = twcr;
+        else
+            twi_complete(I2C_SUCCESS, 1);
+        break;
+    case 0x20:                              // SLA+W not acknowledged
+    case 0x48:                              // SLA+R not acknowledged
+        twi_complete(I2C_ER_NACK, 1);
+        break;
+    case 0x30:                              // data not acknowledged
+        twi_complete(I2C_ER_DATA_NACK, 1);
+        break;
+    case 0x38:                              // arbitration lost
+        twi_complete(I2C_ER_ARBITRATION, 0);
+        break;
+    case 0x40:                              // SLA+R acknowledged
+        TWCR = (t->read_len > 1) ? TWCR_RUN | (1 << TWEA) : TWCR_RUN;
+        break;
+    case 0x50:                              // data received, ACK sent
+        t->read[position++] = TWDR;
+        TWCR = (position + 1 < t->read_len) ? TWCR_RUN | (1 << TWEA) : TWCR_RUN;
+        break;
+    case 0x58:                              // last byte received, NACK sent
+        t->read[position] = TWDR;
+        twi_complete(I2C_SUCCESS, 1);
+        break;
+    default:                                // bus error
+        twi_complete(I2C_ER_BUS, 1);
+        break;
+    }
+}
+
+ISR(TWI_vect) {
+    twi_service();
+}
+
+/*
+ * Queue a transaction, it starts at once if the bus is idle
+ * t: transaction, its status is I2C_PENDING until it is done
+ * Returns: I2C_SUCCESS if queued, I2C_ER_FULL otherwise
+ */
+uint8_t i2c_submit(I2C_TRANSACTION *t) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (queue_count == I2C_QUEUE_SIZE)
+            return I2C_ER_FULL;
+        t->status = I2C_PENDING;
+        queue[(queue_head + queue_count) % I2C_QUEUE_SIZE] = t;
+        queue_count++;
+        if (!running) {                     // else started by twi_complete()
+            running = 1;
+            twi_wait_stop();                // STOP of a byte by byte transfer
+            phase = PHASE_HEADER;
+            position = 0;
+            TWCR = TWCR_RUN | (1 << TWSTA);
+        }
+    }
+    return I2C_SUCCESS;
+}
+
+/*
+ * Check for queued or running transactions
+ * Returns: non-zero while the engine owns the bus
+ */
+uint8_t i2c_busy(void) {
+    return queue_count != 0;
+}
+
+/*
+ * Wait for all the queued transactions
+ * a transaction stuck for I2C_TIMEOUT_MS ends with I2C_ER_TIMEOUT, the bus is
+ * recovered and the next one started
+ */
+void i2c_wait(void) {
+    uint32_t loops = I2C_LOOPS;
+    uint8_t seen = events;
+
+    while (queue_count) {
+        if (!(SREG & (1 << SREG_I)) && (TWCR & (1 << TWINT)))
+            twi_service();
+        if (seen != events) {
+            seen = events;
+            loops = I2C_LOOPS;
+        } else if (!--loops) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (queue_count && seen == events) {
+                    i2c_recover();
+                    twi_complete(I2C_ER_TIMEOUT, 1);
+                }
+            }
+            loops = I2C_LOOPS;
+        }
+    }
+}
+
+#elif defined(USI_I2C)
+
+// USI I2C master for ATtiny25/45/85 (Atmel AVR310)
+// the USI shifts the data and counts the clock edges, SCL is toggled by
+// software with the minimum times of the I2C spec, _delay_us() turns them
+// into cycles of F_CPU. The slave may stretch SCL, it is waited for
+
+#if I2C_SPEED > 100000UL
+  #define I2C_T_LOW     1.3   // us, SCL low
+  #define I2C_T_HIGH    0.6   // us, SCL high, also start/stop setup and hold
+  #define I2C_T_BUF     1.3   // us, bus free between stop and start
+#else
+  #define I2C_T_LOW     4.7
+  #define I2C_T_HIGH    4.0
+  #define I2C_T_BUF     4.7
+#endif
+
+// two-wire mode, the 4-bit counter counts the SCL edges made by USITC
+#define USI_CLOCK  ((1 << USIWM1) | (1 << USICS1) | (1 << USICLK) | (1 << USITC))
+// clear the flags, the counter overflows after 16 edges (8 bits) or 2 (1 bit)
+#define USI_8BIT   ((1 << USISIF) | (1 << USIOIF) | (1 << USIPF) | (1 << USIDC) | (0x0 << USICNT0))
+#define USI_1BIT   ((1 << USISIF) | (1 << USIOIF) | (1 << USIPF) | (1 << USIDC) | (0xE << USICNT0))
+
+#define I2C_SDA    (1 << I2C_SDA_PIN)
+#define I2C_SCL    (1 << I2C_SCL_PIN)
+
+static uint8_t bus_timeout;                 // a slave held SCL low too long
+
+/*
+ * Wait for SCL to be released, a slave may stretch the clock
+ */
+static void usi_wait_scl(void) {
+    uint32_t loops = I2C_LOOPS;
+
+    while (!(PINB & I2C_SCL)) {
+        if (!--loops) {
+            bus_timeout = 1;
+            return;
+        }
+    }
+}
+
+/*
+ * Clock bits through the USI until the counter overflows
+ * usisr: USI_8BIT or USI_1BIT
+ * Returns: the data register, the bits read from SDA
+ */
+static uint8_t usi_transfer(uint8_t usisr) {
+    uint8_t data;
+
+    USISR = usisr;
+    do {
+        _delay_us(I2C_T_LOW);
+        USICR = USI_CLOCK;                  // SCL rising edge
+        usi_wait_scl();                     // clock stretching
+        _delay_us(I2C_T_HIGH);
+        USICR = USI_CLOCK;                  // SCL falling edge
+    } while (!(USISR & (1 << USIOIF)));
+    _delay_us(I2C_T_LOW);
+    data = USIDR;
+    USIDR = 0xFF;                           // release SDA
+    DDRB |= I2C_SDA;
+    return data;
+}
+
+void i2c_init(void) {
+    PORTB |= I2C_SDA | I2C_SCL;             // released: the USI drives them low only
+    DDRB |= I2C_SDA | I2C_SCL;
+    USIDR = 0xFF;
+    USICR = (1 << USIWM1) | (1 << USICS1) | (1 << USICLK);
+    USISR = (1 << USISIF) | (1 << USIOIF) | (1 << USIPF) | (1 << USIDC);
+}
+
+/*
+ * Start condition, also a repeated start
+ * a slave holding SDA low is first released by i2c_recover()
+ * Returns: 0 = success, I2C_ER_TIMEOUT if SCL stays low
+ */
+uint8_t i2c_start(void) {
+    bus_timeout = 0;
+    PORTB |= I2C_SCL;
+    usi_wait_scl();
+    if (!(PINB & I2C_SDA))
+        i2c_recover();
+    _delay_us(I2C_T_LOW);                   // repeated start setup time
+    PORTB &= ~I2C_SDA;
+    _delay_us(I2C_T_HIGH);
+    PORTB &= ~I2C_SCL;
+    PORTB |= I2C_SDA;                       // the USI data register drives SDA now
+    return bus_timeout ? I2C_ER_TIMEOUT : I2C_SUCCESS;
+}
+
+void i2c_stop(void) {
+    PORTB &= ~I2C_SDA;
+    PORTB |= I2C_SCL;
+    usi_wait_scl();
+    _delay_us(I2C_T_HIGH);
+    PORTB |= I2C_SDA;
+    _delay_us(I2C_T_BUF);
+}
+
+/*
+ * Send a byte
+ * Returns: 1 if the slave acknowledged, 0 otherwise
+ */
+uint8_t i2c_write(uint8_t data) {
+    PORTB &= ~I2C_SCL;
+    USIDR = data;
+    usi_transfer(USI_8BIT);
+    DDRB &= ~I2C_SDA;                       // the slave drives the acknowledge
+    return !(usi_transfer(USI_1BIT) & 0x01) && !bus_timeout;
+}
+
+/*
+ * Receive a byte
+ * ack: 1 to acknowledge (more bytes to read), 0 for the last byte
+ */
+uint8_t i2c_read(uint8_t ack) {
+    uint8_t data;
+
+    DDRB &= ~I2C_SDA;
+    data = usi_transfer(USI_8BIT);
+    USIDR = ack ? 0x00 : 0xFF;
+    usi_transfer(USI_1BIT);
+    return data;
+}
+
 #else
 
 // Software I2C for ATtiny (bit-banging)
@@ -57,7 +504,9 @@ uint8_t i2c_read(uint8_t ack) {
 #define I2C_SCL_LOW()  (DDRB |= (1 << I2C_SCL_PIN))
 #define I2C_SDA_READ() (PINB & (1 << I2C_SDA_PIN))
 
-#define I2C_DELAY() _delay_us(5)
+#define I2C_DELAY() _delay_us(500000.0 / I2C_SPEED)  // half a clock
+
+static const uint8_t bus_timeout = 0;       // SCL is not read back, no clock stretching
 
 void i2c_init(void) {
     PORTB &= ~((1 << I2C_SDA_PIN) | (1 << I2C_SCL_PIN)); // Pull-ups off, output low
@@ -65,13 +514,16 @@ void i2c_init(void) {
     I2C_SCL_HIGH();
 }
 
-void i2c_start(void) {
+uint8_t i2c_start(void) {
     I2C_SDA_HIGH();
     I2C_SCL_HIGH();
     I2C_DELAY();
+    if (!I2C_SDA_READ())                    // a slave holds SDA low
+        i2c_recover();
     I2C_SDA_LOW();
     I2C_DELAY();
     I2C_SCL_LOW();
+    return I2C_SUCCESS;
 }
 
 void i2c_stop(void) {
@@ -139,3 +591,75 @@ uint8_t i2c_read(uint8_t ack) {
 
 #endif
 
+#ifndef HARDWARE_I2C
+
+/*
+ * The tinies run at the I2C_SPEED of the build, the delays are compile time
+ * freq: in Hz, I2C_SPEED or above
+ * Returns: 0 = success, I2C_ER_SPEED if freq is below I2C_SPEED
+ */
+uint8_t i2c_init_hz(uint32_t freq) {
+    i2c_init();
+    return freq < I2C_SPEED ? I2C_ER_SPEED : I2C_SUCCESS;
+}
+
+/*
+ * Send a block after the address, stops at the first byte not acknowledged
+ * Returns: 0 = success, I2C_ER_DATA_NACK, I2C_ER_TIMEOUT
+ */
+uint8_t i2c_write_block(const uint8_t *data, uint16_t len) {
+    while (len--) {
+        if (!i2c_write(*data++))
+            return bus_timeout ? I2C_ER_TIMEOUT : I2C_ER_DATA_NACK;
+    }
+    return I2C_SUCCESS;
+}
+
+/*
+ * Receive a block after the address, every byte but the last is acknowledged
+ * Returns: 0 = success, I2C_ER_TIMEOUT
+ */
+uint8_t i2c_read_block(uint8_t *data, uint16_t len) {
+    while (len--)
+        *data++ = i2c_read(len != 0);
+    return bus_timeout ? I2C_ER_TIMEOUT : I2C_SUCCESS;
+}
+
+#endif
+
+/*
+ * Bus clear: a slave reset or glitched in the middle of a read holds SDA low,
+ * up to 9 SCL clocks let it shift the byte out, then START and STOP free the bus
+ * the pins are driven by hand (low or released), the master is set up again after
+ * Returns: 0 = success, I2C_ER_BUS if SDA or SCL is still held low
+ */
+uint8_t i2c_recover(void) {
+    uint8_t pullups = BUS_PORT & (BUS_SDA | BUS_SCL);
+    uint8_t i;
+
+#if defined(HARDWARE_I2C)
+    TWCR = 0;                               // the pins go back to the port
+#elif defined(USI_I2C)
+    USICR = 0;
+#endif
+    BUS_DDR &= ~(BUS_SDA | BUS_SCL);
+    BUS_PORT &= ~(BUS_SDA | BUS_SCL);       // low when output, released when input
+    for (i = 0; i < 9 && !(BUS_PIN & BUS_SDA); i++) {
+        BUS_DDR |= BUS_SCL;
+        _delay_us(5);
+        BUS_DDR &= ~BUS_SCL;
+        _delay_us(5);
+    }
+    BUS_DDR |= BUS_SDA;                     // START, then STOP: SDA rises while SCL is high
+    _delay_us(5);
+    BUS_DDR &= ~BUS_SDA;
+    _delay_us(5);
+    i = (BUS_PIN & (BUS_SDA | BUS_SCL)) == (BUS_SDA | BUS_SCL);
+    BUS_PORT |= pullups;
+#ifdef HARDWARE_I2C
+    TWCR = (1 << TWEN);
+#else
+    i2c_init();
+#endif
+    return i ? I2C_SUCCESS : I2C_ER_BUS;
+}
@@ -4,6 +4,8 @@
 // For ATtiny: define software I2C pins before including this header
 // Example: #define I2C_SDA_PIN PB0
 //          #define I2C_SCL_PIN PB2
+// On the ATtiny25/45/85 the default pins are those of the USI, which then
+// shifts the bytes; any other pins are bit-banged
 
 #ifdef __AVR_ATtiny13__
   #ifndef I2C_SDA_PIN
@@ -41,10 +43,63 @@
   #endif
 #endif
 
+// MCUs with the TWI: the bytes are sent by the hardware, and the transactions
+// can be queued and run by the TWI interrupt
+#if defined(__AVR_ATmega328P__)  || defined(__AVR_ATmega328__)  || \
+    defined(__AVR_ATmega1284P__) || defined(__AVR_ATmega1284__) || \
+    defined(__AVR_ATmega168__)   || defined(__AVR_ATmega88__)   || \
+    defined(__AVR_ATmega2560__)  || defined(__AVR_ATmega48__)
+  #define HARDWARE_I2C
+#endif
+
+// Status of the block transfers and of the queued transactions
+#define I2C_SUCCESS          0x00
+#define I2C_PENDING          0x01  // queued or running
+#define I2C_ER_FULL          0x02  // the queue is full, not queued
+#define I2C_ER_NACK          0x03  // no acknowledge of the address
+#define I2C_ER_DATA_NACK     0x04  // a written byte was not acknowledged
+#define I2C_ER_ARBITRATION   0x05  // another master took the bus
+#define I2C_ER_BUS           0x06  // illegal start/stop, or the bus can't be freed
+#define I2C_ER_TIMEOUT       0x07  // the bus was stuck, it was recovered
+#define I2C_ER_SPEED         0x08  // the clock can't be reached
+
 void i2c_init(void);
-void i2c_start(void);
+uint8_t i2c_init_hz(uint32_t freq);
+uint8_t i2c_start(void);
 void i2c_stop(void);
 uint8_t i2c_write(uint8_t data);
 uint8_t i2c_read(uint8_t ack);
+uint8_t i2c_write_block(const uint8_t *data, uint16_t len);
+uint8_t i2c_read_block(uint8_t *data, uint16_t len);
+uint8_t i2c_recover(void);
+
+#ifdef HARDWARE_I2C
+
+#ifndef I2C_QUEUE_SIZE
+  #define I2C_QUEUE_SIZE 4
+#endif
+
+// A transaction: START, address+W, header, write buffer, then if read_len is
+// set a repeated START, address+R and read_len bytes, then STOP
+// it is owned by the engine from i2c_submit() until its status is not
+// I2C_PENDING any more: it and its buffers must stay valid and unchanged
+typedef struct i2c_transaction {
+    uint8_t address;                         // 7-bit slave address
+    uint8_t header[2];                       // register or control bytes, sent first
+    uint8_t header_len;
+    const uint8_t *write;
+    uint16_t write_len;
+    uint8_t *read;
+    uint16_t read_len;
+    void (*done)(struct i2c_transaction *);  // called from the interrupt, or NULL
+    void *context;                           // free for the caller
+    volatile uint8_t status;
+} I2C_TRANSACTION;
+
+uint8_t i2c_submit(I2C_TRANSACTION *t);
+uint8_t i2c_busy(void);
+void i2c_wait(void);
+
+#endif
 
 #endif // I2C_H
@@ -6,6 +6,8 @@ INCLUDE_DIR = $(PROJECT_ROOT)/include
 
 BUILD_DIR = build
 
+# LIB_SUFFIX is inserted before the MCU in the object and library names, for the
+# variants of a library built with other options (spi and sdcard: the SPI backend)
 MCUS ?= atmega328p atmega1284 atmega1284p atmega2560 attiny13 attiny25 attiny45 attiny85
 
 
@@ -14,79 +16,79 @@ $(BUILD_DIR):
 	mkdir -p $(BUILD_DIR)
 
 # Pattern rule for object files
-$(BUILD_DIR)/%_atmega328p.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_atmega328p.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=atmega328p -DF_CPU=16000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_atmega1284.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_atmega1284.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=atmega1284 -DF_CPU=16000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_atmega1284p.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_atmega1284p.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=atmega1284p -DF_CPU=16000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_atmega2560.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_atmega2560.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=atmega2560 -DF_CPU=16000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_attiny13.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_attiny13.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=attiny13 -DF_CPU=9600000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_attiny25.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_attiny25.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=attiny25 -DF_CPU=8000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_attiny45.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_attiny45.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=attiny45 -DF_CPU=8000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_attiny85.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_attiny85.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=attiny85 -DF_CPU=8000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
-$(BUILD_DIR)/%_attiny2313.o: %.c %.h | $(BUILD_DIR)
+$(BUILD_DIR)/%$(LIB_SUFFIX)_attiny2313.o: %.c %.h | $(BUILD_DIR)
 	$(CC) $(CFLAGS) -mmcu=attiny85 -DF_CPU=8000000UL -DBAUD=$(BAUD) -I. -I$(INCLUDE_DIR) -c $< -o $@
 
 # Pattern rule for libraries
-$(BUILD_DIR)/lib%_atmega328p.a: $(BUILD_DIR)/%_atmega328p.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_atmega328p.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_atmega328p.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_atmega1284.a: $(BUILD_DIR)/%_atmega1284.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_atmega1284.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_atmega1284.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_atmega1284p.a: $(BUILD_DIR)/%_atmega1284p.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_atmega1284p.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_atmega1284p.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_atmega2560.a: $(BUILD_DIR)/%_atmega2560.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_atmega2560.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_atmega2560.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_attiny13.a: $(BUILD_DIR)/%_attiny13.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_attiny13.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_attiny13.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_attiny25.a: $(BUILD_DIR)/%_attiny25.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_attiny25.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_attiny25.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_attiny45.a: $(BUILD_DIR)/%_attiny45.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_attiny45.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_attiny45.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_attiny85.a: $(BUILD_DIR)/%_attiny85.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_attiny85.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_attiny85.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
-$(BUILD_DIR)/lib%_attiny2313.a: $(BUILD_DIR)/%_attiny2313.o
+$(BUILD_DIR)/lib%$(LIB_SUFFIX)_attiny2313.a: $(BUILD_DIR)/%$(LIB_SUFFIX)_attiny2313.o
 	$(AR) rcs $@ $^
 	$(SIZE) $@
 
 # Default single MCU build
 MCU ?= atmega1284p
-LIB = $(BUILD_DIR)/lib$(TARGET)_$(MCU).a
+LIB = $(BUILD_DIR)/lib$(TARGET)$(LIB_SUFFIX)_$(MCU).a
 
 all: $(LIB)
 
 # Build all
 all-mcus: \
-	$(foreach mcu,$(MCUS),$(BUILD_DIR)/lib$(TARGET)_$(mcu).a)
+	$(foreach mcu,$(MCUS),$(BUILD_DIR)/lib$(TARGET)$(LIB_SUFFIX)_$(mcu).a)
 
 # Install
 install: $(LIB) $(TARGET).h
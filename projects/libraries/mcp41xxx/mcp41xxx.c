@@ -3,22 +3,16 @@
 #include <spi.h>
 #include <mcp41xxx.h>
 
-static uint8_t spi_initialized = 0;
+// Helper to send command, nothing is sent while another device holds the bus
+// Returns: SPI_SUCCESS or SPI_ER_BUSY
+static uint8_t send_command(SPI_DEVICE *spi, uint8_t cmd, uint8_t data) {
+  uint8_t frame[2] = { cmd, data };
 
-// Helper to initialize SPI (shared by both)
-static void ensure_spi_init(void) {
-  if (!spi_initialized) {
-    spi_init(16, 0, 0);  // 1MHz, CPOL=0, CPHA=0
-    spi_initialized = 1;
-  }
-}
-
-// Helper to send command
-static void send_command(uint8_t cs_pin, uint8_t cmd, uint8_t data) {
-  PORTB &= ~(1 << cs_pin);  // CS low
-  spi_transfer(cmd);
-  spi_transfer(data);
-  PORTB |= (1 << cs_pin);   // CS high
+  if (spi_select(spi) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
+  spi_write_block(frame, 2);
+  spi_deselect(spi);
+  return SPI_SUCCESS;
 }
 
 // ========== MCP41xxx (Single Pot) ==========
@@ -27,30 +21,33 @@ void mcp41_init(MCP41 *pot, uint8_t cs_pin) {
   pot->cs_pin = cs_pin;
   pot->current_pos = MCP41_MID;
   
-  DDRB |= (1 << cs_pin);
-  PORTB |= (1 << cs_pin);
-  
-  ensure_spi_init();
+  // CS on port B, mode 0, MSB first
+  spi_register(&pot->spi, &DDRB, &PORTB, cs_pin, SPI_MODE0, SPI_MSB_FIRST, MCP41_SPI_KHZ);
   mcp41_set_wiper(pot, MCP41_MID);
 }
 
-void mcp41_set_wiper(MCP41 *pot, uint8_t value) {
+// The position is only updated when the frame was sent
+uint8_t mcp41_set_wiper(MCP41 *pot, uint8_t value) {
+  if (send_command(&pot->spi, MCP41_CMD_WRITE, value) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
   pot->current_pos = value;
-  send_command(pot->cs_pin, MCP41_CMD_WRITE, value);
+  return SPI_SUCCESS;
 }
 
-void mcp41_increment(MCP41 *pot) {
+uint8_t mcp41_increment(MCP41 *pot) {
   if (pot->current_pos < MCP41_MAX)
-    mcp41_set_wiper(pot, pot->current_pos + 1);
+    return mcp41_set_wiper(pot, pot->current_pos + 1);
+  return SPI_SUCCESS;
 }
 
-void mcp41_decrement(MCP41 *pot) {
+uint8_t mcp41_decrement(MCP41 *pot) {
   if (pot->current_pos > MCP41_MIN)
-    mcp41_set_wiper(pot, pot->current_pos - 1);
+    return mcp41_set_wiper(pot, pot->current_pos - 1);
+  return SPI_SUCCESS;
 }
 
-void mcp41_shutdown(MCP41 *pot) {
-  send_command(pot->cs_pin, MCP41_CMD_SHUTDOWN, 0x00);
+uint8_t mcp41_shutdown(MCP41 *pot) {
+  return send_command(&pot->spi, MCP41_CMD_SHUTDOWN, 0x00);
 }
 
 uint8_t mcp41_get_position(MCP41 *pot) {
@@ -64,54 +61,58 @@ void mcp42_init(MCP42 *pot, uint8_t cs_pin) {
   pot->current_pos0 = MCP41_MID;
   pot->current_pos1 = MCP41_MID;
   
-  DDRB |= (1 << cs_pin);
-  PORTB |= (1 << cs_pin);
-  
-  ensure_spi_init();
+  // CS on port B, mode 0, MSB first
+  spi_register(&pot->spi, &DDRB, &PORTB, cs_pin, SPI_MODE0, SPI_MSB_FIRST, MCP41_SPI_KHZ);
   mcp42_set_both(pot, MCP41_MID, MCP41_MID);
 }
 
-void mcp42_set_pot0(MCP42 *pot, uint8_t value) {
+uint8_t mcp42_set_pot0(MCP42 *pot, uint8_t value) {
+  if (send_command(&pot->spi, MCP42_CMD_WRITE_POT0, value) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
   pot->current_pos0 = value;
-  send_command(pot->cs_pin, MCP42_CMD_WRITE_POT0, value);
+  return SPI_SUCCESS;
 }
 
-void mcp42_set_pot1(MCP42 *pot, uint8_t value) {
+uint8_t mcp42_set_pot1(MCP42 *pot, uint8_t value) {
+  if (send_command(&pot->spi, MCP42_CMD_WRITE_POT1, value) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
   pot->current_pos1 = value;
-  send_command(pot->cs_pin, MCP42_CMD_WRITE_POT1, value);
+  return SPI_SUCCESS;
 }
 
-void mcp42_set_both(MCP42 *pot, uint8_t val0, uint8_t val1) {
-  pot->current_pos0 = val0;
-  pot->current_pos1 = val1;
-  
-  // Send to pot0 first, then pot1
-  send_command(pot->cs_pin, MCP42_CMD_WRITE_POT0, val0);
-  send_command(pot->cs_pin, MCP42_CMD_WRITE_POT1, val1);
+// Send to pot0 first, then pot1, each position follows its own frame
+uint8_t mcp42_set_both(MCP42 *pot, uint8_t val0, uint8_t val1) {
+  if (mcp42_set_pot0(pot, val0) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
+  return mcp42_set_pot1(pot, val1);
 }
 
-void mcp42_increment_pot0(MCP42 *pot) {
+uint8_t mcp42_increment_pot0(MCP42 *pot) {
   if (pot->current_pos0 < MCP41_MAX)
-    mcp42_set_pot0(pot, pot->current_pos0 + 1);
+    return mcp42_set_pot0(pot, pot->current_pos0 + 1);
+  return SPI_SUCCESS;
 }
 
-void mcp42_decrement_pot0(MCP42 *pot) {
+uint8_t mcp42_decrement_pot0(MCP42 *pot) {
   if (pot->current_pos0 > MCP41_MIN)
-    mcp42_set_pot0(pot, pot->current_pos0 - 1);
+    return mcp42_set_pot0(pot, pot->current_pos0 - 1);
+  return SPI_SUCCESS;
 }
 
-void mcp42_increment_pot1(MCP42 *pot) {
+uint8_t mcp42_increment_pot1(MCP42 *pot) {
   if (pot->current_pos1 < MCP41_MAX)
-    mcp42_set_pot1(pot, pot->current_pos1 + 1);
+    return mcp42_set_pot1(pot, pot->current_pos1 + 1);
+  return SPI_SUCCESS;
 }
 
-void mcp42_decrement_pot1(MCP42 *pot) {
+uint8_t mcp42_decrement_pot1(MCP42 *pot) {
   if (pot->current_pos1 > MCP41_MIN)
-    mcp42_set_pot1(pot, pot->current_pos1 - 1);
+    return mcp42_set_pot1(pot, pot->current_pos1 - 1);
+  return SPI_SUCCESS;
 }
 
-void mcp42_shutdown(MCP42 *pot) {
-  send_command(pot->cs_pin, MCP42_CMD_SHUTDOWN_BOTH, 0x00);
+uint8_t mcp42_shutdown(MCP42 *pot) {
+  return send_command(&pot->spi, MCP42_CMD_SHUTDOWN_BOTH, 0x00);
 }
 
 uint8_t mcp42_get_position0(MCP42 *pot) {
@@ -1,6 +1,9 @@
 #ifndef MCP41XXX_H
 #define MCP41XXX_H
 
+#include <stdint.h>
+#include <spi.h>
+
 // MCP41XXX Commands (single pot)
 #define MCP41_CMD_WRITE    0x11  // Write data to wiper
 #define MCP41_CMD_SHUTDOWN 0x21  // Shutdown wiper
@@ -18,10 +21,14 @@
 #define MCP41_MAX   255
 #define MCP41_MID   128
 
+// Highest SPI clock of the MCP41xxx/42xxx (datasheet: 10 MHz)
+#define MCP41_SPI_KHZ 10000
+
 // Single pot (MCP41xxx)
 typedef struct {
   uint8_t cs_pin;
   uint8_t current_pos;
+  SPI_DEVICE spi;
 } MCP41;
 
 // Dual pot (MCP42xxx)
@@ -29,26 +36,30 @@ typedef struct {
   uint8_t cs_pin;
   uint8_t current_pos0;  // Pot 0 position
   uint8_t current_pos1;  // Pot 1 position
+  SPI_DEVICE spi;
 } MCP42;
 
+// The write and shutdown functions return SPI_SUCCESS, or SPI_ER_BUSY when another
+// device holds the bus: nothing is sent and the stored position is unchanged
+
 // MCP41xxx functions (single pot)
 void mcp41_init(MCP41 *pot, uint8_t cs_pin);
-void mcp41_set_wiper(MCP41 *pot, uint8_t value);
-void mcp41_increment(MCP41 *pot);
-void mcp41_decrement(MCP41 *pot);
-void mcp41_shutdown(MCP41 *pot);
+uint8_t mcp41_set_wiper(MCP41 *pot, uint8_t value);
+uint8_t mcp41_increment(MCP41 *pot);
+uint8_t mcp41_decrement(MCP41 *pot);
+uint8_t mcp41_shutdown(MCP41 *pot);
 uint8_t mcp41_get_position(MCP41 *pot);
 
 // MCP42xxx functions (dual pot)
 void mcp42_init(MCP42 *pot, uint8_t cs_pin);
-void mcp42_set_pot0(MCP42 *pot, uint8_t value);
-void mcp42_set_pot1(MCP42 *pot, uint8_t value);
-void mcp42_set_both(MCP42 *pot, uint8_t val0, uint8_t val1);
-void mcp42_increment_pot0(MCP42 *pot);
-void mcp42_decrement_pot0(MCP42 *pot);
-void mcp42_increment_pot1(MCP42 *pot);
-void mcp42_decrement_pot1(MCP42 *pot);
-void mcp42_shutdown(MCP42 *pot);
+uint8_t mcp42_set_pot0(MCP42 *pot, uint8_t value);
+uint8_t mcp42_set_pot1(MCP42 *pot, uint8_t value);
+uint8_t mcp42_set_both(MCP42 *pot, uint8_t val0, uint8_t val1);
+uint8_t mcp42_increment_pot0(MCP42 *pot);
+uint8_t mcp42_decrement_pot0(MCP42 *pot);
+uint8_t mcp42_increment_pot1(MCP42 *pot);
+uint8_t mcp42_decrement_pot1(MCP42 *pot);
+uint8_t mcp42_shutdown(MCP42 *pot);
 uint8_t mcp42_get_position0(MCP42 *pot);
 uint8_t mcp42_get_position1(MCP42 *pot);
 
@@ -1,20 +1,31 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#if !defined(SPI_USE_MSPIM) && defined(SPDR)
+#define SPI_INLINE    // the data CRC is computed while SPDR shifts, see sd_read_crc16()
+#endif
 #include <spi.h>
 #include <sdcard.h>
 #include <timer.h>
 
-#define CPOL                  0
-#define CPHA                  0
-#define SD_INIT_SPEED       100
-#define SD_FAST_SPEED      1000 // 2500 works with gigastone
+#define SD_INIT_SPEED       400 // identification clock, the SD spec allows 100 to 400 kHz
+#define SD_FAST_SPEED      1000 // used when the CSD can't be read
+#define SD_MIN_SPEED        250 // the clock is never lowered below this after errors
+#ifndef SD_MAX_SPEED
+#define SD_MAX_SPEED      25000 // upper limit for the CSD TRAN_SPEED (long wires: -DSD_MAX_SPEED=...)
+#endif
 
 #define DUMMY_CLOCKS         80
-#define POWER_UP_DELAY       50
-#define GO_IDLE_STATE_RETRY  10
-#define SEND_IF_COND_RETRY   10
-#define SEND_OP_COND_RETRY 1000 
+#define POWER_UP_DELAY        1 // ms, the SD spec asks 1ms once the supply is up
+#define GO_IDLE_TIMEOUT     250 // ms, CMD0 is retried while the card supply settles
+#define SEND_IF_COND_TIMEOUT 50 // ms
+#define SEND_OP_COND_TIMEOUT 1000 // ms, ACMD41 initialization limit (SD spec: 1s)
+#define CMD_RESPONSE_TRIES   16 // bytes polled for R1 (NCR is 0 to 8 bytes)
+#define READ_TIMEOUT        200 // ms, data token limit (SD spec: 100ms)
+#define WRITE_TIMEOUT       500 // ms, card programming time limit (SDHC spec: 250ms)
+#define ERASE_TIMEOUT     30000 // ms, the erase time grows with the range
 
 typedef enum {
   ST_POWER_UP,
@@ -24,29 +35,266 @@ typedef enum {
   ST_APP_CMD,
   ST_SEND_OP_COND,
   ST_SET_BLOCKLEN,
+  ST_SEND_CSD,
   ST_READY
 } sd_init_state_t;
 
 uint8_t sdcard_type;
+SPI_DEVICE sd_spi;
+static bool sd_crc_on = false;
+static unsigned long sd_sectors = 0;
+static uint16_t sd_max_khz = SD_FAST_SPEED;
+static bool sd_busy = false;    /* a write was accepted, the card may still be programming */
+static bool sd_streaming = false;        /* a READ_MULTIPLE_BLOCK is open, the card stays selected */
+static unsigned long sd_stream_next = 0; /* block the open READ_MULTIPLE_BLOCK delivers next */
+static bool sd_writing = false;          /* a WRITE_MULTIPLE_BLOCK is open, deselected between blocks */
+static unsigned long sd_write_left = 0;  /* blocks announced by sd_write_open() not written yet */
+static bool sd_powered = false;  /* the last sd_init() succeeded, the card is in SPI mode */
+static uint16_t sd_init_ms = 0;  /* duration of the last sd_init() */
 
 uint8_t sd_type() {
   return sdcard_type;
 }
 
-uint8_t sd_crc7_byte(uint8_t crc, uint8_t data) {
-  uint8_t i;
-  
-  for (i = 0; i < 8; i++) {
-    crc <<= 1;
-    if ((crc ^ data) & 0x80) 
-      crc ^= 0x09;
-    data <<= 1;
+/*
+ * Get the card capacity in 512-byte blocks read from the CSD by sd_init()
+ * Returns: 0 if unknown
+ */
+unsigned long sd_sector_count(void) {
+  return sd_sectors;
+}
+
+/*
+ * Get the SPI clock negotiated with the card in kHz
+ * it is lowered automatically after CRC or data token errors
+ */
+uint16_t sd_clock_khz(void) {
+  return spi_get_device_khz(&sd_spi);
+}
+
+/*
+ * CRC tables, one lookup per byte instead of 8 shift/xor steps
+ * crc7_table holds the 7-bit CRC left aligned (bit 0 is the end bit of the command)
+ * crc16_table is the CRC16-CCITT (x^16 + x^12 + x^5 + 1) used for the data blocks
+ */
+static const uint8_t crc7_table[256] PROGMEM = {
+  0x00, 0x12, 0x24, 0x36, 0x48, 0x5A, 0x6C, 0x7E, 0x90, 0x82, 0xB4, 0xA6, 0xD8, 0xCA, 0xFC, 0xEE,
+  0x32, 0x20, 0x16, 0x04, 0x7A, 0x68, 0x5E, 0x4C, 0xA2, 0xB0, 0x86, 0x94, 0xEA, 0xF8, 0xCE, 0xDC,
+  0x64, 0x76, 0x40, 0x52, 0x2C, 0x3E, 0x08, 0x1A, 0xF4, 0xE6, 0xD0, 0xC2, 0xBC, 0xAE, 0x98, 0x8A,
+  0x56, 0x44, 0x72, 0x60, 0x1E, 0x0C, 0x3A, 0x28, 0xC6, 0xD4, 0xE2, 0xF0, 0x8E, 0x9C, 0xAA, 0xB8,
+  0xC8, 0xDA, 0xEC, 0xFE, 0x80, 0x92, 0xA4, 0xB6, 0x58, 0x4A, 0x7C, 0x6E, 0x10, 0x02, 0x34, 0x26,
+  0xFA, 0xE8, 0xDE, 0xCC, 0xB2, 0xA0, 0x96, 0x84, 0x6A, 0x78, 0x4E, 0x5C, 0x22, 0x30, 0x06, 0x14,
+  0xAC, 0xBE, 0x88, 0x9A, 0xE4, 0xF6, 0xC0, 0xD2, 0x3C, 0x2E, 0x18, 0x0A, 0x74, 0x66, 0x50, 0x42,
+  0x9E, 0x8C, 0xBA, 0xA8, 0xD6, 0xC4, 0xF2, 0xE0, 0x0E, 0x1C, 0x2A, 0x38, 0x46, 0x54, 0x62, 0x70,
+  0x82, 0x90, 0xA6, 0xB4, 0xCA, 0xD8, 0xEE, 0xFC, 0x12, 0x00, 0x36, 0x24, 0x5A, 0x48, 0x7E, 0x6C,
+  0xB0, 0xA2, 0x94, 0x86, 0xF8, 0xEA, 0xDC, 0xCE, 0x20, 0x32, 0x04, 0x16, 0x68, 0x7A, 0x4C, 0x5E,
+  0xE6, 0xF4, 0xC2, 0xD0, 0xAE, 0xBC, 0x8A, 0x98, 0x76, 0x64, 0x52, 0x40, 0x3E, 0x2C, 0x1A, 0x08,
+  0xD4, 0xC6, 0xF0, 0xE2, 0x9C, 0x8E, 0xB8, 0xAA, 0x44, 0x56, 0x60, 0x72, 0x0C, 0x1E, 0x28, 0x3A,
+  0x4A, 0x58, 0x6E, 0x7C, 0x02, 0x10, 0x26, 0x34, 0xDA, 0xC8, 0xFE, 0xEC, 0x92, 0x80, 0xB6, 0xA4,
+  0x78, 0x6A, 0x5C, 0x4E, 0x30, 0x22, 0x14, 0x06, 0xE8, 0xFA, 0xCC, 0xDE, 0xA0, 0xB2, 0x84, 0x96,
+  0x2E, 0x3C, 0x0A, 0x18, 0x66, 0x74, 0x42, 0x50, 0xBE, 0xAC, 0x9A, 0x88, 0xF6, 0xE4, 0xD2, 0xC0,
+  0x1C, 0x0E, 0x38, 0x2A, 0x54, 0x46, 0x70, 0x62, 0x8C, 0x9E, 0xA8, 0xBA, 0xC4, 0xD6, 0xE0, 0xF2,
+};
+
+static const uint16_t crc16_table[256] PROGMEM = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+static inline uint8_t sd_crc7_byte(uint8_t crc, uint8_t data) {
+  return pgm_read_byte(&crc7_table[crc ^ data]);
+}
+
+static inline uint16_t sd_crc16_byte(uint16_t crc, uint8_t data) {
+  return (crc << 8) ^ pgm_read_word(&crc16_table[(uint8_t)(crc >> 8) ^ data]);
+}
+
+static uint8_t sd_read_stop_selected(void);
+static uint8_t sd_write_close_selected(void);
+
+/*
+ * Receive a data packet and compute its CRC16
+ * the crc of a byte is computed while the next one is shifted. With the SPDR
+ * backend SPDR is read and the next 0xFF sent at once, so the store and the
+ * table lookup (about 20 cycles a byte) run during the 16 cycles of the shift
+ * buffer: buffer to store the data
+ * len: packet length, at least 2
+ * Returns: the CRC16 of the packet
+ */
+static uint16_t sd_read_crc16(uint8_t *buffer, unsigned int len)
+{
+  uint16_t crc = 0;
+  uint8_t b0, b1;
+
+#ifdef SPI_INLINE
+  SPDR = 0xFF;
+  len--;
+  while (len >= 2) {
+    SPI_WAIT(); b0 = SPDR; SPDR = 0xFF;
+    buffer[0] = b0;
+    crc = sd_crc16_byte(crc, b0);
+    SPI_WAIT(); b1 = SPDR; SPDR = 0xFF;
+    buffer[1] = b1;
+    crc = sd_crc16_byte(crc, b1);
+    buffer += 2;
+    len -= 2;
+  }
+  if (len) {
+    SPI_WAIT(); b0 = SPDR; SPDR = 0xFF;
+    *buffer++ = b0;
+    crc = sd_crc16_byte(crc, b0);
+  }
+  SPI_WAIT();
+  b1 = SPDR;
+#else
+  spi_begin_transfer(0xFF);
+  while (--len) {
+    b0 = spi_end_transfer();
+    spi_begin_transfer(0xFF);
+    *buffer++ = b0;
+    crc = sd_crc16_byte(crc, b0);
+  }
+  b1 = spi_end_transfer();
+#endif
+  *buffer = b1;
+  return sd_crc16_byte(crc, b1);
+}
+
+/*
+ * Send a data packet and compute its CRC16, the crc runs during the shift
+ * buffer: data to send
+ * len: packet length
+ * Returns: the CRC16 of the packet
+ */
+static uint16_t sd_write_crc16(const uint8_t *buffer, unsigned int len)
+{
+  uint16_t crc = 0;
+  uint8_t data;
+
+  while (len--) {
+    data = *buffer++;
+#ifdef SPI_INLINE
+    SPDR = data;
+    crc = sd_crc16_byte(crc, data);
+    SPI_WAIT();
+#else
+    spi_begin_transfer(data);
+    crc = sd_crc16_byte(crc, data);
+    spi_end_transfer();
+#endif
   }
   return crc;
 }
 
+/*
+ * Poll the busy state, the card must be selected
+ * one poll per byte, about 1ms of bus time is spent for each millisecond of timeout
+ * timeout_ms: maximum wait in milliseconds
+ * Returns: 0 = card ready, non-zero = timeout
+ */
+static uint8_t sd_poll_busy(unsigned int timeout_ms)
+{
+  unsigned int n, bytes_per_ms;
+
+  bytes_per_ms = spi_get_frequency_khz() / 8 + 1;
+  do {
+    for (n = bytes_per_ms; n > 0; n--)
+      if (spi_transfer(0xFF) != 0x00) {
+	sd_busy = false;
+	return ER_SUCCESS;
+      }
+  } while (timeout_ms--);
+  return ER_WRITE_TIMEOUT;
+}
+
+/*
+ * Wait for the data token of a read, the card must be selected
+ * one poll per byte, bounded in time as sd_poll_busy()
+ * timeout_ms: maximum wait in milliseconds
+ * Returns: the first byte that is not 0xFF, 0xFF on timeout
+ */
+static uint8_t sd_poll_token(unsigned int timeout_ms)
+{
+  unsigned int n, bytes_per_ms;
+  uint8_t token;
+
+  bytes_per_ms = spi_get_frequency_khz() / 8 + 1;
+  do {
+    for (n = bytes_per_ms; n > 0; n--)
+      if ((token = spi_transfer(0xFF)) != 0xFF)
+	return token;
+  } while (timeout_ms--);
+  return 0xFF;
+}
+
+/*
+ * Take the bus and select the card, with one clock byte before and after CS
+ * goes low. Nothing is clocked while another device holds the bus
+ * Returns: 0 = success, ER_BUS_BUSY if another device holds the bus
+ */
+uint8_t sd_select(void)
+{
+  if (spi_acquire(&sd_spi) != SPI_SUCCESS)
+    return ER_BUS_BUSY;
+  spi_transfer(0xFF);
+  spi_select(&sd_spi);          /* the bus is ours, it can't fail */
+  spi_transfer(0xFF);
+  return ER_SUCCESS;
+}
+
+/*
+ * Deselect the card and release the bus, one clock byte before and after CS
+ * goes high (the card releases MISO on the clock following CS)
+ * does nothing when the bus is held by another device
+ */
+void sd_deselect(void)
+{
+  if (spi_owner() != &sd_spi)
+    return;
+  spi_transfer(0xFF);
+  spi_deselect(&sd_spi);
+  spi_transfer(0xFF);
+}
+
  uint8_t sd_cmd(uint8_t cmd, uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t arg3) {
   uint8_t crc, a, r;
+
+  if (sd_streaming)
+    sd_read_stop_selected();      /* any command ends the open read-ahead transfer */
+  if (sd_writing)
+    sd_write_close_selected();    /* or the open write stream */
+  if (sd_busy)
+    sd_poll_busy(WRITE_TIMEOUT);  /* finish a write-behind before the next command */
   
   crc = sd_crc7_byte(0, cmd | 0x40);
   spi_transfer(cmd | 0x40);  
@@ -58,9 +306,10 @@ uint8_t sd_crc7_byte(uint8_t crc, uint8_t data) {
   spi_transfer(arg2);  
   crc = sd_crc7_byte(crc, arg3);
   spi_transfer(arg3);  
-  crc = (crc << 1) | 0x01;  
-  spi_transfer(crc);  
-  for (a = 8; a > 0; a++) 
+  spi_transfer(crc | 0x01);  
+  if (cmd == STOP_TRANSMISSION)
+    spi_transfer(0xFF);         /* skip the stuff byte following CMD12 */
+  for (a = CMD_RESPONSE_TRIES; a > 0; a--) 
     if (((r = spi_transfer(0xFF)) & 0x80) == 0)  
       return r;
   return 0xff;
@@ -83,62 +332,93 @@ const char* sd_error_string(uint8_t error_code) {
   case ER_WRITE_SINGLE_BLOCK: return "CMD24  / WRITE_SIGNLE_BLOCK Failed";
   case ER_CMD1:               return "CMD1 Failed";
   case ER_V1_CARD:            return "v1.0 sdcard not supported";
+  case ER_READ_MULTIPLE_BLOCK: return "CMD18  / READ_MULTIPLE_BLOCK Failed";
+  case ER_WRITE_MULTIPLE_BLOCK: return "CMD25  / WRITE_MULTIPLE_BLOCK Failed";
+  case ER_STOP_TRANSMISSION:  return "CMD12  / STOP_TRANSMISSION Failed";
   case ER_ACMD41_TIMEOUT:     return "ACMD41 timeout";
   case ER_UNKNOWN_CMD8:       return "CMD8 returned unexpected response";
   case ER_READ_TOKEN:         return "Read data token timeout/error";
   case ER_READ_TIMEOUT:       return "Read operation timeout";
+  case ER_READ_CRC:           return "Read data CRC error";
   case ER_WRITE_REJECT:       return "Write data rejected";
   case ER_WRITE_TIMEOUT:      return "Write operation timeout";
+  case ER_WRITE_CRC:          return "Write data CRC error";
+  case ER_ERASE:              return "CMD32/33/38 / ERASE Failed";
   case ER_CMD13:              return "CMD13 (READ_STATUS) failed";
   case ER_PROTECTED:          return "sdcard is write protected";
   case ER_LOCKED:             return "sdcard is locked";
+  case ER_SET_BLOCKLEN:       return "CMD16  / SET_BLOCKLEN Failed";
+  case ER_CRC_ON_OFF:         return "CMD59  / CRC_ON_OFF Failed";
+  case ER_SEND_CSD:           return "CMD9   / SEND_CSD Failed";
+  case ER_BUS_BUSY:           return "SPI bus held by another device";
   default:                       
     return NULL;
   };
 }
 
 
- void sd_power_up() {
-  uint8_t i;
-
-  spi_init(100, CPOL, CPHA);
-  spi_set_frequency_khz(SD_INIT_SPEED);
+/*
+ * Send at least 74 clocks with CS high, the card enters the native mode
+ * Returns: 0 = success, ER_BUS_BUSY if another device holds the bus
+ */
+static uint8_t sd_dummy_clocks(void) {
+  if (spi_acquire(&sd_spi) != SPI_SUCCESS)   /* the card clock, CS stays high */
+    return ER_BUS_BUSY;
+  spi_fill(0xFF, DUMMY_CLOCKS/8 + 2);
   sd_deselect();
-  sd_delay(1);
-  for (i = 0; i < DUMMY_CLOCKS/8; i++) 
-    spi_transfer(0xFF);
+  return ER_SUCCESS;
+}
+
+/*
+ * Release hook of the bus: another SPI device is selected while a read stream
+ * keeps the card selected, the stream is closed
+ */
+static void sd_release(void) {
+  sd_read_stop();
+}
+
+ uint8_t sd_power_up() {
+  spi_register(&sd_spi, NULL, NULL, 0, SPI_MODE0, SPI_MSB_FIRST, SD_INIT_SPEED);
+  sd_spi.release = sd_release;
+  if (spi_acquire(&sd_spi) != SPI_SUCCESS)
+    return ER_BUS_BUSY;
   sd_deselect();
+  sd_delay(POWER_UP_DELAY);
+  return sd_dummy_clocks();
 }
 
+/*
+ * The identification commands return the R1 response, R1_NO_RESPONSE
+ * when the bus is held by another device
+ */
  uint8_t sd_go_idle_state() {
   uint8_t r1;
   
-  sd_select();
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
   r1 = sd_cmd(GO_IDLE_STATE, 0x00, 0x00, 0x00, 0x00);
   sd_deselect();
   return r1;
 }
 
  uint8_t sd_send_if_cond(uint8_t *r7_data) {
-  uint8_t i, r1;
+  uint8_t r1;
   
-  sd_select();
-  if ((r1 = sd_cmd(SEND_IF_COND, 0x00, 0x00, 0x01, 0xAA)) == R1_IDLE_STATE) {
-    for (i = 0; i < 4; i++) 
-      r7_data[i] = spi_transfer(0xFF);
-  }
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
+  if ((r1 = sd_cmd(SEND_IF_COND, 0x00, 0x00, 0x01, 0xAA)) == R1_IDLE_STATE)
+    spi_read_block(r7_data, 4);
   sd_deselect();
   return r1;
 }  
   
  uint8_t sd_read_ocr(uint8_t *ocr_data) {
-  uint8_t i, r1;
+  uint8_t r1;
   
-  sd_select();
-  if ((r1 = sd_cmd(READ_OCR, 0x00, 0x00, 0x00, 0x00)) == R1_READY) {
-    for (i = 0; i < 4; i++) 
-      ocr_data[i] = spi_transfer(0xFF);
-  }
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
+  if ((r1 = sd_cmd(READ_OCR, 0x00, 0x00, 0x00, 0x00)) == R1_READY)
+    spi_read_block(ocr_data, 4);
   sd_deselect();
   return r1;
 }
@@ -147,7 +427,8 @@ const char* sd_error_string(uint8_t error_code) {
 {
   uint8_t r1;
 
-  sd_select();
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
   r1 = sd_cmd(APP_CMD, 0x00, 0x00, 0x00, 0x00);
   sd_deselect();
   return r1;
@@ -157,7 +438,8 @@ const char* sd_error_string(uint8_t error_code) {
 {
   uint8_t r1;
 
-  sd_select();
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
   r1 = sd_cmd(SD_SEND_OP_COND, (sdcard_type != SDCARD_V1) ? 0x40 : 0x00, 0x00, 0x00, 0x00);
   sd_deselect();
   return r1;
@@ -167,57 +449,199 @@ uint8_t sd_set_blocklen()
 {
   uint8_t r1;
 
-  sd_select();
+  if (sd_select() != ER_SUCCESS)
+    return R1_NO_RESPONSE;
   r1 = sd_cmd(SET_BLOCKLEN,  0x00, 0x00, 0x02, 0x00);
   sd_deselect();
   return r1;
 }
 
-uint8_t sd_init(void) {
+static uint8_t sd_read_data(uint8_t *, unsigned int);
+
+/*
+ * Read the card specific data register (SEND_CSD / CMD9)
+ * csd: 16-byte buffer
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read_csd(uint8_t *csd)
+{
+  uint8_t res;
+
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  if (sd_cmd(SEND_CSD, 0x00, 0x00, 0x00, 0x00) != R1_READY) 
+    res = ER_SEND_CSD;
+  else 
+    res = sd_read_data(csd, 16);
+  sd_deselect();
+  return res;
+}
+
+/*
+ * Decode TRAN_SPEED (CSD bits 103:96) in kHz
+ * bits 2:0 rate unit (100kbit/s, 1, 10, 100Mbit/s), bits 6:3 time value (1.0 to 8.0)
+ */
+static uint16_t sd_csd_speed_khz(const uint8_t *csd)
+{
+  static const uint8_t time_value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+  static const uint16_t rate_unit[4] = { 10, 100, 1000, 10000 };   /* kHz / 10 */
+  uint32_t khz;
+
+  if ((csd[3] & 0x07) > 3)
+    return SD_FAST_SPEED;
+  khz = (uint32_t)time_value[(csd[3] >> 3) & 0x0F] * rate_unit[csd[3] & 0x07];
+  if (khz == 0)
+    return SD_FAST_SPEED;
+  return (khz > SD_MAX_SPEED) ? SD_MAX_SPEED : (uint16_t)khz;
+}
+
+/*
+ * Decode the card capacity in 512-byte blocks
+ * CSD v2 (SDHC/SDXC): (C_SIZE + 1) * 512KB
+ * CSD v1 (SDSC): (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) * 2^READ_BL_LEN bytes
+ */
+static unsigned long sd_csd_sectors(const uint8_t *csd)
+{
+  unsigned long c_size;
+  uint8_t shift;
+
+  if ((csd[0] >> 6) == 1) {
+    c_size = ((unsigned long)(csd[7] & 0x3F) << 16) | ((unsigned int)csd[8] << 8) | csd[9];
+    return (c_size + 1) << 10;
+  }
+  c_size = ((unsigned int)(csd[6] & 0x03) << 10) | ((unsigned int)csd[7] << 2) | (csd[8] >> 6);
+  shift  = (((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2 + (csd[5] & 0x0F);
+  return (c_size + 1) << (shift - 9);
+}
+
+/*
+ * Erase a range of blocks (ERASE_WR_BLK_START / END + ERASE: CMD32, CMD33, CMD38)
+ * the card marks the blocks as erased, a later write to them doesn't have to
+ * erase first. the content read back is all 0x00 or all 0xFF depending on the card
+ * start: first block to erase
+ * end: last block to erase (included)
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_erase(unsigned long start, unsigned long end)
+{
+  uint8_t res;
+
+  if (end < start)
+    return ER_ERROR;
+  if (sdcard_type != SDCARD_SDHC) {
+    start *= 512;
+    end   *= 512;
+  }
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  res = ER_ERASE;
+  if (sd_cmd(ERASE_WR_BLK_START, (uint8_t)(start >> 24), (uint8_t)(start >> 16), (uint8_t)(start >> 8), (uint8_t)start) == R1_READY &&
+      sd_cmd(ERASE_WR_BLK_END, (uint8_t)(end >> 24), (uint8_t)(end >> 16), (uint8_t)(end >> 8), (uint8_t)end) == R1_READY &&
+      sd_cmd(ERASE, 0x00, 0x00, 0x00, 0x00) == R1_READY) {
+    sd_busy = true;
+    res = sd_poll_busy(ERASE_TIMEOUT);
+  }
+  sd_deselect();
+  return res;
+}
+
+/*
+ * Enable or disable CRC checking (CRC_ON_OFF / CMD59)
+ * when enabled every data block read is verified against its CRC16 and every
+ * block written carries a valid CRC16 checked by the card.
+ * the setting is kept and sent again by sd_init()
+ * enable: true = CRC on, false = CRC off
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_set_crc(uint8_t enable)
+{
+  uint8_t r1;
+
+  if (sd_select() != ER_SUCCESS)
+    return ER_BUS_BUSY;
+  r1 = sd_cmd(CRC_ON_OFF, 0x00, 0x00, 0x00, enable ? 0x01 : 0x00);
+  sd_deselect();
+  if (r1 > R1_IDLE_STATE)
+    return ER_CRC_ON_OFF;
+  sd_crc_on = enable;
+  return ER_SUCCESS;
+}
+
+/*
+ * Get the duration of the last sd_init() in milliseconds
+ * includes the power-up on a cold start, not on a warm re-init
+ */
+uint16_t sd_init_time(void) {
+  return sd_init_ms;
+}
+
+/*
+ * Initialize the card and negotiate the SPI clock
+ * identification runs at SD_INIT_SPEED, each phase is bounded in time by the
+ * timer library millisecond clock on Timer2 (started if needed). The interrupts
+ * are left as they are: with them disabled the clock is polled by timer_millis().
+ * A card that was already initialized (warm re-init) skips the power-up delay
+ * and the dummy clocks, a failure forces a full power-up on the next call.
+ * Returns: 0 = success, non-zero = error
+ */
+static uint8_t sd_identify(void) {
   sd_init_state_t state;
-  int16_t retry;
-  int16_t acmd41_retry;
+  uint32_t start;
   uint8_t r1;
   uint8_t r7_data[4];
   uint8_t ocr_data[4];
+  uint8_t csd[16];
 
   state = ST_POWER_UP;
+  start = 0;
   for (;;) {
     switch(state) {
     case ST_POWER_UP:
-      sd_power_up();
-      sd_delay(POWER_UP_DELAY);
+      if (sd_powered) {
+	if (spi_acquire(&sd_spi) != SPI_SUCCESS)
+	  return ER_BUS_BUSY;
+	sd_read_stop();      /* the card is still selected by an open read */
+	sd_write_close();
+	sd_wait_ready(WRITE_TIMEOUT);
+	spi_set_device_khz(&sd_spi, SD_INIT_SPEED);
+      } else if (sd_power_up() != ER_SUCCESS) {
+	return ER_BUS_BUSY;
+      }
+      sd_streaming = false;  /* CMD0 resets the card, drop any transfer state */
+      sd_writing = false;
+      sd_busy = false;
+      sd_powered = false;
+      start = timer_millis();
       state = ST_GO_IDLE_STATE;
       break;
       
     case ST_GO_IDLE_STATE:
-      for (retry = 0; retry < GO_IDLE_STATE_RETRY; retry++) {
-	if (sd_go_idle_state() == R1_IDLE_STATE) {
-	  state = ST_SEND_IF_COND;
-	  break;
-	}
-      }
-      if (retry >= GO_IDLE_STATE_RETRY)  
+      if (sd_go_idle_state() == R1_IDLE_STATE) {
+	start = timer_millis();
+	state = ST_SEND_IF_COND;
+      } else if (timer_millis() - start < GO_IDLE_TIMEOUT) {
+	if (sd_dummy_clocks() != ER_SUCCESS)  /* supply still rising, or the card was mid-transfer */
+	  return ER_BUS_BUSY;
+      } else {
 	return ER_GO_IDLE_STATE;
+      }
       break;
 
     case ST_SEND_IF_COND:
-      for (retry = 0; retry < SEND_IF_COND_RETRY; retry++) {
-	r1 = sd_send_if_cond(r7_data);
-	if (r1 == R1_IDLE_STATE) {
-	  if (r7_data[3] != 0xAA || (r7_data[2] & 0x01) == 0)
-	    return ER_SEND_IF_COND;
-	  sdcard_type = SDCARD_V2;
-	  state = ST_APP_CMD;
-	  break;
-	} else if (r1 == 0x05) {
-	  sdcard_type = SDCARD_V1;
-	  state = ST_APP_CMD;
-	  break;
-	} 
-      }
-      if (retry >= SEND_IF_COND_RETRY)  // Only error if all retries failed
+      r1 = sd_send_if_cond(r7_data);
+      if (r1 == R1_IDLE_STATE) {
+	if (r7_data[3] != 0xAA || (r7_data[2] & 0x01) == 0)
+	  return ER_SEND_IF_COND;
+	sdcard_type = SDCARD_V2;
+	start = timer_millis();
+	state = ST_APP_CMD;
+      } else if (r1 == R1_ILLEGAL_CMD_IDLE) {
+	sdcard_type = SDCARD_V1;
+	start = timer_millis();
+	state = ST_APP_CMD;
+      } else if (timer_millis() - start >= SEND_IF_COND_TIMEOUT) {
 	return ER_SEND_IF_COND;
+      }
       break;
 
     case ST_READ_OCR:
@@ -234,49 +658,147 @@ uint8_t sd_init(void) {
     case ST_APP_CMD:
       if (sd_send_app() <= R1_IDLE_STATE) 
 	state = ST_SEND_OP_COND;
-      else if (acmd41_retry++ < SEND_OP_COND_RETRY)
-	state = ST_APP_CMD;
-      else
+      else if (timer_millis() - start >= SEND_OP_COND_TIMEOUT)
 	return ER_APP_CMD;
       break;
       
     case ST_SEND_OP_COND:
       if (sd_send_op_cond() == R1_READY)
 	state = ST_READ_OCR;
-      else if (acmd41_retry++ < SEND_OP_COND_RETRY)
+      else if (timer_millis() - start < SEND_OP_COND_TIMEOUT)
 	state = ST_APP_CMD;
       else
-	return ER_SEND_OP_COND;  
+	return ER_ACMD41_TIMEOUT;  
       break;
       
     case ST_SET_BLOCKLEN:
       if (sd_set_blocklen() == R1_READY) 
-	state = ST_READY;
+	state = ST_SEND_CSD;
       else 
 	return ER_SET_BLOCKLEN;
       break;
 
+    case ST_SEND_CSD:
+      if (sd_read_csd(csd) == ER_SUCCESS) {
+	sd_max_khz = sd_csd_speed_khz(csd);
+	sd_sectors = sd_csd_sectors(csd);
+      } else {
+	sd_max_khz = SD_FAST_SPEED;
+	sd_sectors = 0;
+      }
+      state = ST_READY;
+      break;
+
     case ST_READY:
-      spi_set_frequency_khz(SD_FAST_SPEED);    
+      if (sd_crc_on && sd_set_crc(true) != ER_SUCCESS)
+	return ER_CRC_ON_OFF;
+      spi_set_device_khz(&sd_spi, sd_max_khz);
       sd_deselect(); 
+      sd_powered = true;
       return ER_SUCCESS;
     }
   }
 }
 
+uint8_t sd_init(void) {
+  uint32_t start;
+  uint8_t res;
+
+  timer_clock_start();
+  start = timer_millis();
+  res = sd_identify();
+  sd_init_ms = (uint16_t)(timer_millis() - start);
+  return res;
+}
+
 /*
- * Read single block from SD card
- * block_num: block number to read (for SDHC cards, this is the block number)
- * buffer: 512-byte buffer to store the data
+ * Wait for a data token and read one data packet
+ * the card must be selected and a read command already accepted
+ * buffer: buffer to store the data
+ * len: packet length (512 for a block, 16 for the CSD)
  * Returns: 0 = success, non-zero = error
  */
-uint8_t sd_read(unsigned long block_num, uint8_t *buffer)
+static uint8_t sd_read_data(uint8_t *buffer, unsigned int len)
 {
   uint8_t token;
-  unsigned int i, a;
   uint8_t crc1, crc2;
+  uint16_t crc;
+
+  if ((token = sd_poll_token(READ_TIMEOUT)) != DATA_START_TOKEN)
+    return (token == 0xFF) ? ER_READ_TIMEOUT : ER_READ_TOKEN;
+  if (!sd_crc_on) {
+    spi_read_block(buffer, len);
+    spi_fill(0xFF, 2);     /* crc not checked */
+    return ER_SUCCESS;
+  }
+  crc = sd_read_crc16(buffer, len);
+  crc1 = spi_transfer(0xFF);
+  crc2 = spi_transfer(0xFF);
+  if (crc != (((uint16_t)crc1 << 8) | crc2))
+    return ER_READ_CRC;
+  return ER_SUCCESS;
+}
+
+/*
+ * Terminate a multiple block transfer
+ * the card must be selected, waits until the card is no more busy
+ * Returns: 0 = success, non-zero = error
+ */
+static uint8_t sd_stop_transmission(void)
+{
+  if (sd_cmd(STOP_TRANSMISSION, 0x00, 0x00, 0x00, 0x00) > R1_IDLE_STATE)
+    return ER_STOP_TRANSMISSION;
+  if (sd_poll_busy(READ_TIMEOUT) != ER_SUCCESS)
+    return ER_STOP_TRANSMISSION;
+  return ER_SUCCESS;
+}
+
+/*
+ * Close the open read-ahead transfer, the card stays selected
+ * Returns: 0 = success, non-zero = error
+ */
+static uint8_t sd_read_stop_selected(void)
+{
+  sd_streaming = false;
+  return sd_stop_transmission();
+}
+
+/*
+ * Read one block of a sequential read
+ * the READ_MULTIPLE_BLOCK transfer is left open after the block, so when the next
+ * call asks for the following block it is read without sending a command
+ */
+static uint8_t sd_read_ahead(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
+  unsigned long address;
+
+  if (!sd_streaming || block_num != sd_stream_next) {
+    sd_read_stop();
+    if ((res = sd_select()) != ER_SUCCESS)
+      return res;
+    address = (sdcard_type != SDCARD_SDHC) ? block_num * 512 : block_num;
+    if (sd_cmd(READ_MULTIPLE_BLOCK, (uint8_t)(address >> 24), (uint8_t)(address >> 16), 
+	       (uint8_t)(address >> 8), (uint8_t)(address)) != 0x00) {
+      sd_deselect();
+      return ER_READ_MULTIPLE_BLOCK;
+    }
+    sd_streaming = true;
+  }
+  if ((res = sd_read_data(buffer, SD_BLOCK_SIZE)) != ER_SUCCESS) {
+    sd_read_stop();
+    return res;
+  }
+  sd_stream_next = block_num + 1;
+  return ER_SUCCESS;
+}
+
+static uint8_t sd_read_block(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
   
-  sd_select();
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
   if (sdcard_type != SDCARD_SDHC)
     block_num *= 512;
   if (sd_cmd(READ_SINGLE_BLOCK, (uint8_t)(block_num >> 24), (uint8_t)(block_num >> 16), 
@@ -284,39 +806,135 @@ uint8_t sd_read(unsigned long block_num, uint8_t *buffer)
     sd_deselect();
     return ER_READ_SINGLE_BLOCK;
   }
-  for(a = 5000; a > 0; a--) {
-    if ((token = spi_transfer(0xFF))  == DATA_START_TOKEN) {
-      for (i = 0; i < SD_BLOCK_SIZE; i++) 
-	buffer[i] = spi_transfer(0xFF);
-      crc1 = spi_transfer(0xFF);
-      crc2 = spi_transfer(0xFF);
-      (void) crc1;
-      (void) crc2;
-      sd_deselect();
-      return ER_SUCCESS;
-    } else if (token != 0xFF) {
-      sd_deselect();
-      return ER_READ_TOKEN;
-    }
+  res = sd_read_data(buffer, SD_BLOCK_SIZE);
+  sd_deselect();
+  return res;
+}
+
+/*
+ * Read part of a block from SD card without a 512-byte buffer
+ * the whole block is clocked but only the requested range is delivered
+ * block_num: block number to read
+ * offset: offset of the first byte to deliver in the block
+ * len: number of bytes to deliver (offset + len <= 512)
+ * buffer: len-byte buffer to store the data, or NULL to use sink
+ * sink: called for each delivered byte when buffer is NULL
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read_stream(unsigned long block_num, uint16_t offset, uint16_t len, uint8_t *buffer, sd_sink_t sink)
+{
+  uint8_t token, data, crc1, crc2;
+  unsigned int i, end;
+  uint16_t crc;
+
+  if (offset >= SD_BLOCK_SIZE || len > SD_BLOCK_SIZE - offset || (buffer == NULL && sink == NULL))
+    return ER_ERROR;
+  if (sd_select() != ER_SUCCESS)
+    return ER_BUS_BUSY;
+  if (sdcard_type != SDCARD_SDHC)
+    block_num *= 512;
+  if (sd_cmd(READ_SINGLE_BLOCK, (uint8_t)(block_num >> 24), (uint8_t)(block_num >> 16), 
+	     (uint8_t)(block_num >> 8), (uint8_t)(block_num)) != 0x00) {
+    sd_deselect();
+    return ER_READ_SINGLE_BLOCK;
   }
+  if ((token = sd_poll_token(READ_TIMEOUT)) != DATA_START_TOKEN) {
+    sd_deselect();
+    return (token == 0xFF) ? ER_READ_TIMEOUT : ER_READ_TOKEN;
+  }
+  end = offset + len;
+  if (!sd_crc_on && buffer) {
+    /* the bytes around the part are only clocked, the crc is skipped */
+    spi_fill(0xFF, offset);
+    spi_read_block(buffer, len);
+    spi_fill(0xFF, SD_BLOCK_SIZE - end + 2);
+    sd_deselect();
+    return ER_SUCCESS;
+  }
+  crc = 0;
+  for (i = 0; i < SD_BLOCK_SIZE; i++) {
+    data = spi_transfer(0xFF);
+    if (sd_crc_on)
+      crc = sd_crc16_byte(crc, data);
+    if (i < offset || i >= end)
+      continue;
+    if (buffer)
+      *buffer++ = data;
+    else
+      sink(data);
+  }
+  crc1 = spi_transfer(0xFF);
+  crc2 = spi_transfer(0xFF);
+  sd_deselect();
+  if (sd_crc_on && crc != (((uint16_t)crc1 << 8) | crc2))
+    return ER_READ_CRC;
+  return ER_SUCCESS;
+}
+
+static uint8_t sd_read_blocks(unsigned long block_num, unsigned int count, uint8_t *buffer)
+{
+  uint8_t res, stop;
+  
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  if (sdcard_type != SDCARD_SDHC)
+    block_num *= 512;
+  if (sd_cmd(READ_MULTIPLE_BLOCK, (uint8_t)(block_num >> 24), (uint8_t)(block_num >> 16), 
+	     (uint8_t)(block_num >> 8), (uint8_t)(block_num)) != 0x00) {
+    sd_deselect();
+    return ER_READ_MULTIPLE_BLOCK;
+  }
+  res = ER_SUCCESS;
+  while (count--) {
+    if ((res = sd_read_data(buffer, SD_BLOCK_SIZE)) != ER_SUCCESS)
+      break;
+    buffer += SD_BLOCK_SIZE;
+  }
+  stop = sd_stop_transmission();
   sd_deselect();
-  return ER_READ_TIMEOUT;
+  return (res != ER_SUCCESS) ? res : stop;
 }
 
 /*
- * Write single block to SD card
- * block_num: block number to write
+ * Send one 512-byte data packet and wait for the end of programming
+ * the card must be selected and a write command already accepted
+ * token: DATA_START_TOKEN for CMD24, WRITE_MULTI_TOKEN for CMD25
  * buffer: 512-byte buffer containing data to write
+ * wait: false to return as soon as the data is accepted (the card is left busy)
  * Returns: 0 = success, non-zero = error
  */
-uint8_t sd_write(unsigned long block_num, uint8_t *buffer)
+static uint8_t sd_write_data(uint8_t token, uint8_t *buffer, bool wait)
 {
   uint8_t data_response;
-  unsigned int i;
-  uint8_t status;
-  unsigned int timeout;
+  uint16_t crc;
 
-  sd_select();
+  spi_transfer(token);
+  if (!sd_crc_on) {
+    spi_write_block(buffer, SD_BLOCK_SIZE);
+    spi_fill(0xFF, 2);     /* dummy crc */
+  } else {
+    crc = sd_write_crc16(buffer, SD_BLOCK_SIZE);
+    spi_transfer((uint8_t)(crc >> 8));
+    spi_transfer((uint8_t)crc);
+  }
+  data_response = spi_transfer(0xFF) & 0x1F;
+  if (data_response == DATA_REJECT_CRC) 
+    return ER_WRITE_CRC;
+  if (data_response != DATA_ACCEPT_TOKEN) 
+    return ER_WRITE_REJECT;
+  if (!wait) {
+    sd_busy = true;
+    return ER_SUCCESS;
+  }
+  return sd_poll_busy(WRITE_TIMEOUT);
+}
+
+static uint8_t sd_write_block(unsigned long block_num, uint8_t *buffer, bool wait)
+{
+  uint8_t res;
+
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
   if (sd_cmd(SEND_STATUS, 0x00, 0x00, 0x00, 0x00) == 0x00) {
     switch(spi_transfer(0xFF)) {
     case 0x00:
@@ -332,27 +950,306 @@ uint8_t sd_write(unsigned long block_num, uint8_t *buffer)
     sd_deselect();
     return ER_WRITE_SINGLE_BLOCK;
   }
-  spi_transfer(DATA_START_TOKEN);
-  for (i = 0; i < SD_BLOCK_SIZE; i++) 
-    spi_transfer(buffer[i]);
-  spi_transfer(0xFF);
+  res = sd_write_data(DATA_START_TOKEN, buffer, wait);
+  sd_deselect();
+  return res;
+}
+
+static uint8_t sd_write_blocks(unsigned long block_num, unsigned int count, uint8_t *buffer)
+{
+  uint8_t res, stop;
+
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  if (sd_cmd(APP_CMD, 0x00, 0x00, 0x00, 0x00) <= R1_IDLE_STATE)
+    sd_cmd(SET_WR_BLK_ERASE_COUNT, 0x00, 0x00, (uint8_t)(count >> 8), (uint8_t)(count));
+  if (sdcard_type != SDCARD_SDHC)
+    block_num *= 512;
+  if (sd_cmd(WRITE_MULTIPLE_BLOCK, (uint8_t)(block_num >> 24), (uint8_t)(block_num >> 16), 
+	     (uint8_t)(block_num >> 8), (uint8_t)(block_num)) != 0x00) {
+    sd_deselect();
+    return ER_WRITE_MULTIPLE_BLOCK;
+  }
+  res = ER_SUCCESS;
+  while (count--) {
+    if ((res = sd_write_data(WRITE_MULTI_TOKEN, buffer, true)) != ER_SUCCESS)
+      break;
+    buffer += SD_BLOCK_SIZE;
+  }
+  spi_transfer(STOP_TRAN_TOKEN);
   spi_transfer(0xFF);
-  data_response = spi_transfer(0xFF);
-  if ((data_response & 0x1F) != DATA_ACCEPT_TOKEN) {
+  stop = sd_poll_busy(WRITE_TIMEOUT);
+  sd_deselect();
+  return (res != ER_SUCCESS) ? res : stop;
+}
+
+/*
+ * Lower the SPI clock after a transfer error that may be caused by a too fast bus
+ * res: error returned by the transfer
+ * Returns: true if the clock was lowered and the transfer can be retried
+ */
+static bool sd_step_down(uint8_t res)
+{
+  uint8_t divisor;
+
+  if (res != ER_READ_CRC && res != ER_READ_TOKEN && res != ER_WRITE_CRC)
+    return false;
+  divisor = sd_spi.divisor;
+  if (divisor >= spi_calculate_divisor(SD_MIN_SPEED))
+    return false;
+  spi_set_device_khz(&sd_spi, spi_get_device_khz(&sd_spi) / 2);
+  return true;
+}
+
+/*
+ * Read single block from SD card
+ * block_num: block number to read (for SDHC cards, this is the block number)
+ * buffer: 512-byte buffer to store the data
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_read_block(block_num, buffer)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Read consecutive blocks from SD card in a single READ_MULTIPLE_BLOCK transfer
+ * block_num: first block number to read
+ * count: number of blocks to read
+ * buffer: count * 512-byte buffer to store the data
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read_multi(unsigned long block_num, unsigned int count, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_read_blocks(block_num, count, buffer)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Read a block of a sequential access (read-ahead)
+ * the first block starts a READ_MULTIPLE_BLOCK transfer that stays open with the
+ * card selected, each following block is then read straight from the card's
+ * stream. The transfer is closed with STOP_TRANSMISSION by a block that doesn't
+ * follow, by any other command or by sd_read_stop(). Call sd_read_stop() before
+ * using another device on the SPI bus.
+ * block_num: block number to read
+ * buffer: 512-byte buffer to store the data
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read_sequential(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_read_ahead(block_num, buffer)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Close the read-ahead transfer opened by sd_read_sequential() and release the card
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_read_stop(void)
+{
+  uint8_t res;
+
+  if (!sd_streaming)
+    return ER_SUCCESS;
+  if (spi_owner() != &sd_spi)   /* the stream keeps the bus, this is only a guard */
+    return ER_BUS_BUSY;
+  res = sd_read_stop_selected();
+  sd_deselect();
+  return res;
+}
+
+/*
+ * Write single block to SD card
+ * block_num: block number to write
+ * buffer: 512-byte buffer containing data to write
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_write(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_write_block(block_num, buffer, true)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Start writing a single block to SD card (write-behind)
+ * returns as soon as the card has accepted the data, the card then programs the
+ * block on its own. The next command waits for the end of programming, use
+ * sd_ready() or sd_wait_ready() to check it explicitly.
+ * block_num: block number to write
+ * buffer: 512-byte buffer containing data to write, can be reused on return
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_write_begin(unsigned long block_num, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_write_block(block_num, buffer, false)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Check if the card has finished programming the last write-behind block
+ * Returns: 1 = ready for the next command, 0 = still busy (or the bus is held
+ * by another device, the card is then not polled)
+ */
+uint8_t sd_ready(void)
+{
+  if (sd_busy) {
+    if (sd_select() != ER_SUCCESS)
+      return 0;
+    if (spi_transfer(0xFF) != 0x00)
+      sd_busy = false;
     sd_deselect();
-    return ER_WRITE_REJECT;
   }
-  timeout = 0;
-  while (timeout < 65000U) {
-    status = spi_transfer(0xFF);
-    if (status != 0x00)
-      break; 
-    timeout++;
+  return !sd_busy;
+}
+
+/*
+ * Wait for the end of programming of the last write-behind block
+ * timeout_ms: maximum wait in milliseconds
+ * Returns: 0 = success, non-zero = timeout
+ */
+uint8_t sd_wait_ready(unsigned int timeout_ms)
+{
+  uint8_t res;
+
+  if (!sd_busy)
+    return ER_SUCCESS;
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  res = sd_poll_busy(timeout_ms);
+  sd_deselect();
+  return res;
+}
+
+/*
+ * Write consecutive blocks to SD card in a single WRITE_MULTIPLE_BLOCK transfer
+ * the number of blocks is announced first with SET_WR_BLK_ERASE_COUNT (ACMD23)
+ * so the card can pre-erase the whole area
+ * block_num: first block number to write
+ * count: number of blocks to write
+ * buffer: count * 512-byte buffer containing data to write
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_write_multi(unsigned long block_num, unsigned int count, uint8_t *buffer)
+{
+  uint8_t res;
+
+  while ((res = sd_write_blocks(block_num, count, buffer)) != ER_SUCCESS && sd_step_down(res))
+    ;
+  return res;
+}
+
+/*
+ * Open a WRITE_MULTIPLE_BLOCK stream for sd_write_next()
+ * the number of blocks is announced with SET_WR_BLK_ERASE_COUNT (ACMD23) so the
+ * card can pre-erase the area. The card is deselected between blocks: the bus
+ * stays free for other devices while the card programs.
+ * block_num: first block number to write
+ * count: number of blocks that will be written (ACMD23 takes 23 bits)
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_write_open(unsigned long block_num, unsigned long count)
+{
+  uint8_t res;
+
+  sd_read_stop();
+  sd_write_close();
+  if (count == 0 || count > 0x7FFFFFUL)
+    return ER_ERROR;
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  if (sd_cmd(APP_CMD, 0x00, 0x00, 0x00, 0x00) <= R1_IDLE_STATE)
+    sd_cmd(SET_WR_BLK_ERASE_COUNT, 0x00, (uint8_t)(count >> 16), (uint8_t)(count >> 8), (uint8_t)(count));
+  if (sdcard_type != SDCARD_SDHC)
+    block_num *= 512;
+  if (sd_cmd(WRITE_MULTIPLE_BLOCK, (uint8_t)(block_num >> 24), (uint8_t)(block_num >> 16), 
+	     (uint8_t)(block_num >> 8), (uint8_t)(block_num)) != 0x00) {
+    sd_deselect();
+    return ER_WRITE_MULTIPLE_BLOCK;
+  }
+  sd_deselect();
+  sd_writing = true;
+  sd_write_left = count;
+  return ER_SUCCESS;
+}
+
+/*
+ * Write the next block of the stream opened by sd_write_open()
+ * returns as soon as the card has accepted the data (write-behind): sd_ready()
+ * tells when the card can take the next block without waiting
+ * buffer: 512-byte buffer containing data to write, can be reused on return
+ * Returns: 0 = success, non-zero = error (the stream is closed)
+ */
+uint8_t sd_write_next(uint8_t *buffer)
+{
+  uint8_t res;
+
+  if (!sd_writing || sd_write_left == 0)
+    return ER_WRITE_MULTIPLE_BLOCK;
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;               /* the stream stays open, retry later */
+  if (sd_busy && (res = sd_poll_busy(WRITE_TIMEOUT)) != ER_SUCCESS) {
+    sd_deselect();
+    return res;
   }
-  if (timeout >= 65000U) {
+  res = sd_write_data(WRITE_MULTI_TOKEN, buffer, false);
+  if (res != ER_SUCCESS) {
+    sd_write_close_selected();
     sd_deselect();
-    return ER_WRITE_TIMEOUT;
+    return res;
   }
   sd_deselect();
+  sd_write_left--;
   return ER_SUCCESS;
 }
+
+/*
+ * Close the write stream, the card must be selected
+ */
+static uint8_t sd_write_close_selected(void)
+{
+  uint8_t res;
+
+  sd_writing = false;
+  if (sd_busy)
+    sd_poll_busy(WRITE_TIMEOUT);
+  spi_transfer(STOP_TRAN_TOKEN);
+  spi_transfer(0xFF);
+  res = sd_poll_busy(WRITE_TIMEOUT);
+  return res;
+}
+
+/*
+ * Close the write stream opened by sd_write_open() and wait for the end of
+ * programming. Blocks announced but not written keep their previous content
+ * (or are erased, depending on the card)
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sd_write_close(void)
+{
+  uint8_t res;
+
+  if (!sd_writing)
+    return ER_SUCCESS;
+  if ((res = sd_select()) != ER_SUCCESS)
+    return res;
+  res = sd_write_close_selected();
+  sd_deselect();
+  return res;
+}
@@ -6,11 +6,15 @@
 #ifndef SDCARD_H
 #define SDCARD_H
 
+#include <spi.h>
+
 /* SD Card block size */
 #define SD_BLOCK_SIZE            512
 
 /* Data tokens */
 #define DATA_START_TOKEN         0xFE
+#define WRITE_MULTI_TOKEN        0xFC  /* data block of a WRITE_MULTIPLE_BLOCK */
+#define STOP_TRAN_TOKEN          0xFD  /* end of a WRITE_MULTIPLE_BLOCK */
 #define DATA_ACCEPT_TOKEN        0x05
 #define DATA_REJECT_CRC          0x0B
 #define DATA_REJECT_WRITE        0x0D
@@ -29,18 +33,27 @@
 #define ER_WRITE_SINGLE_BLOCK    0x08  /* CMD24 (WRITE_BLOCK) failed */
 #define ER_CMD1                  0x09  /* CMD1 (SEND_OP_COND) failed */
 #define ER_V1_CARD               0x0A  /* SD v1.x card detected (not supported) */
+#define ER_READ_MULTIPLE_BLOCK   0x0B  /* CMD18 (READ_MULTIPLE_BLOCK) failed */
+#define ER_WRITE_MULTIPLE_BLOCK  0x0C  /* CMD25 (WRITE_MULTIPLE_BLOCK) failed */
+#define ER_STOP_TRANSMISSION     0x0D  /* CMD12 (STOP_TRANSMISSION) failed */
+#define ER_SEND_CSD              0x0E  /* CMD9 (SEND_CSD) failed */
 
 /* Additional error codes for other functions */
 #define ER_ACMD41_TIMEOUT        0x12  /* ACMD41 timeout */
 #define ER_UNKNOWN_CMD8          0x20  /* CMD8 returned unexpected response */
 #define ER_READ_TOKEN            0x21  /* Read data token timeout/error */
 #define ER_READ_TIMEOUT          0x22  /* Read operation timeout */
+#define ER_READ_CRC              0x23  /* Read data CRC mismatch */
 #define ER_WRITE_REJECT          0x31  /* Write data rejected */
 #define ER_WRITE_TIMEOUT         0x32  /* Write operation timeout */
+#define ER_WRITE_CRC             0x33  /* Write data rejected by card CRC check */
+#define ER_ERASE                 0x34  /* CMD32/CMD33/CMD38 (ERASE) failed */
 #define ER_CMD13                 0x40  /* CMD13 (READ_STATUS) failed */
 #define ER_PROTECTED             0x41  /* sdcard is write protected */
 #define ER_LOCKED                0x42  /* sdcard is locked */
 #define ER_SET_BLOCKLEN          0x43  /* SET_BLOCKLEN failed */
+#define ER_CRC_ON_OFF            0x44  /* CRC_ON_OFF failed */
+#define ER_BUS_BUSY              0x50  /* another SPI device holds the bus */
 
 #define R1_READY                 0x00
 #define R1_IDLE_STATE            0x01
@@ -67,7 +80,7 @@
 #define SEND_STATUS             13   // CMD13
 #define SET_BLOCKLEN            16   // CMD16
 #define READ_SINGLE_BLOCK       17   // CMD17
-#define READ_MULTIPLE_BLOCK     18   // CMD17
+#define READ_MULTIPLE_BLOCK     18   // CMD18
 #define WRITE_SINGLE_BLOCK      24   // CMD24
 #define WRITE_MULTIPLE_BLOCK    25   // CMD25
 #define PROGRAM_CSD             27   // CMD27
@@ -87,15 +100,37 @@
 #define SEND_SCR                51   // ACMD51
 
 #define sd_delay(ms)    timer_delay_ms(ms)
-#define sd_select()     spi_transfer(0xff); spi_cs_low();  spi_transfer(0xff)
-#define sd_deselect()   spi_transfer(0xff); spi_cs_high(); spi_transfer(0xff)
 
+/* The card on the SPI bus: board CS, mode 0, clock negotiated by sd_init() */
+extern SPI_DEVICE sd_spi;
+
+/* Receives the bytes of a partial block read, one call per byte */
+typedef void (*sd_sink_t)(uint8_t);
 
+uint8_t     sd_select(void);
+void        sd_deselect(void);
 uint8_t     sd_cmd(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
 uint8_t     sd_read(unsigned long, uint8_t *);
+uint8_t     sd_read_multi(unsigned long, unsigned int, uint8_t *);
+uint8_t     sd_read_sequential(unsigned long, uint8_t *);
+uint8_t     sd_read_stop(void);
+uint8_t     sd_read_stream(unsigned long, uint16_t, uint16_t, uint8_t *, sd_sink_t);
 uint8_t     sd_write(unsigned long , uint8_t *);
+uint8_t     sd_write_multi(unsigned long, unsigned int, uint8_t *);
+uint8_t     sd_write_begin(unsigned long, uint8_t *);
+uint8_t     sd_write_open(unsigned long, unsigned long);
+uint8_t     sd_write_next(uint8_t *);
+uint8_t     sd_write_close(void);
+uint8_t     sd_ready(void);
+uint8_t     sd_wait_ready(unsigned int);
 uint8_t     sd_init(void);
+uint16_t    sd_init_time(void);
 uint8_t     sd_type(void);
+uint8_t     sd_erase(unsigned long, unsigned long);
+uint8_t     sd_set_crc(uint8_t);
+uint8_t     sd_read_csd(uint8_t *);
+unsigned long sd_sector_count(void);
+uint16_t    sd_clock_khz(void);
 const char* sd_error_string(uint8_t);
 
 
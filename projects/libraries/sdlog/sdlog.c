@@ -0,0 +1,240 @@
+/*
+ * File: sdlog.c
+ * SD card data logger: sustained rate logging to a pre-allocated contiguous file
+ *
+ * sdlog_open() creates the file with f_expand() so its sectors are one known
+ * LBA range, then the data goes to the card with a single open
+ * WRITE_MULTIPLE_BLOCK stream (sd_write_open/next): no FAT or directory update
+ * until sdlog_close() sets the final size.
+ * The producers (ADC or UART interrupts...) fill one of two 512-byte buffers
+ * with sdlog_putc()/sdlog_write(), the main loop calls sdlog_task() which sends
+ * the full buffer while the other one keeps filling, so the card busy times
+ * (up to 250ms on SDHC) are absorbed without stopping the producers.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <util/atomic.h>
+#include <sdcard.h>
+#include <timer.h>
+#include "ff.h"
+#include "diskio.h"
+#include "sdlog.h"
+
+static FIL log_file;
+static uint8_t logging = 0;
+static uint32_t capacity;        /* bytes pre-allocated */
+static uint32_t next_sector;     /* sectors written since the start of the file */
+static uint32_t sector_count;    /* sectors pre-allocated */
+
+static uint8_t buffers[2][SD_BLOCK_SIZE];
+static volatile uint8_t fill;        /* buffer the producers are filling */
+static volatile uint16_t fill_len;   /* bytes in it */
+static volatile uint8_t pending;     /* the other buffer is full, waiting for the card */
+static volatile uint32_t pending_since;
+static volatile SDLOG_STATS stats;
+
+/*
+ * Hand the buffer being filled over to sdlog_task(), interrupts disabled
+ */
+static void log_swap(void) {
+  pending = 1;
+  pending_since = timer_millis();
+  fill ^= 1;
+  fill_len = 0;
+}
+
+/*
+ * Store one byte, interrupts disabled
+ * Returns: 0 = success, non-zero = error
+ */
+static uint8_t log_put(uint8_t c) {
+  if (!logging)
+    return SDLOG_ER_STATE;
+  if (stats.bytes >= capacity) {
+    stats.dropped++;
+    return SDLOG_ER_FULL;
+  }
+  if (fill_len == SD_BLOCK_SIZE) {
+    stats.dropped++;     /* both buffers full: the card is late */
+    return SDLOG_ER_OVERRUN;
+  }
+  buffers[fill][fill_len++] = c;
+  stats.bytes++;
+  if (fill_len == SD_BLOCK_SIZE && !pending)
+    log_swap();
+  return SDLOG_SUCCESS;
+}
+
+/*
+ * Create a contiguous log file and open the raw write stream on its sectors
+ * the volume must be mounted. The whole area is erased first (CTRL_TRIM) so
+ * the card doesn't have to erase while logging: this takes a moment on a
+ * large file
+ * path: file name, an existing file is replaced
+ * size: bytes to pre-allocate, the maximum the log can hold
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sdlog_open(const char *path, uint32_t size) {
+  FATFS *fs;
+  LBA_t range[2];
+
+  if (logging)
+    return SDLOG_ER_STATE;
+  if (size == 0)
+    return SDLOG_ER_OPEN;
+  if (f_open(&log_file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    return SDLOG_ER_OPEN;
+  if (f_expand(&log_file, size, 1) != FR_OK || f_sync(&log_file) != FR_OK) {
+    f_close(&log_file);
+    f_unlink(path);
+    return SDLOG_ER_OPEN;
+  }
+
+  /* first sector of the start cluster, as clst2sect() in ff.c */
+  fs = log_file.obj.fs;
+  sector_count = (size + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+  range[0] = fs->database + (LBA_t)fs->csize * (log_file.obj.sclust - 2);
+  range[1] = range[0] + sector_count - 1;
+  /* also drops the diskio cache lines of the area: the data bypasses diskio */
+  disk_ioctl(fs->pdrv, CTRL_TRIM, range);
+  if (sd_write_open(range[0], sector_count) != SD_SUCCESS) {
+    f_close(&log_file);
+    f_unlink(path);
+    return SDLOG_ER_CARD;
+  }
+
+  capacity = size;
+  next_sector = 0;
+  memset((void *)&stats, 0, sizeof(stats));
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    fill = 0;
+    fill_len = 0;
+    pending = 0;
+    logging = 1;
+  }
+  return SDLOG_SUCCESS;
+}
+
+/*
+ * Log one byte, from an interrupt handler or from the main loop
+ * Returns: 0 = success, non-zero = error (the byte is dropped)
+ */
+uint8_t sdlog_putc(uint8_t c) {
+  uint8_t res;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    res = log_put(c);
+  }
+  return res;
+}
+
+/*
+ * Log a record, from an interrupt handler or from the main loop
+ * the record is copied with the interrupts disabled: keep it short
+ * Returns: 0 = success, non-zero = error (part of the record is dropped)
+ */
+uint8_t sdlog_write(const uint8_t *data, uint16_t len) {
+  uint8_t res = SDLOG_SUCCESS;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    while (len--) {
+      if ((res = log_put(*data++)) != SDLOG_SUCCESS) {
+        stats.dropped += len;
+        break;
+      }
+    }
+  }
+  return res;
+}
+
+/*
+ * Send the full buffer to the card (waits if the card is busy) and hand the
+ * other one over if it filled up meanwhile
+ * Returns: 0 = success, non-zero = error
+ */
+static uint8_t log_flush(void) {
+  uint32_t waited;
+
+  if (next_sector >= sector_count)
+    return SDLOG_ER_FULL;
+  /* pending is set: the producers are on the other buffer */
+  if (sd_write_next(buffers[fill ^ 1]) != SD_SUCCESS)
+    return SDLOG_ER_CARD;
+  next_sector++;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    waited = timer_millis() - pending_since;
+    if (waited > stats.max_wait_ms)
+      stats.max_wait_ms = (waited > 0xFFFF) ? 0xFFFF : (uint16_t)waited;
+    stats.sectors++;
+    pending = 0;
+    if (fill_len == SD_BLOCK_SIZE)
+      log_swap();
+  }
+  return SDLOG_SUCCESS;
+}
+
+/*
+ * Write the full buffer to the card, call it from the main loop as often as
+ * possible. Never waits for the card: returns at once while it is busy
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sdlog_task(void) {
+  if (!logging)
+    return SDLOG_ER_STATE;
+  if (!pending || !sd_ready())
+    return SDLOG_SUCCESS;
+  return log_flush();
+}
+
+/*
+ * Flush the buffers, close the write stream and truncate the file to the
+ * bytes logged (the partial last sector is padded with zeros on the card)
+ * after a card error the file ends with the last sector written: the bytes
+ * accepted but left in the buffers are not part of it
+ * Returns: 0 = success, non-zero = error
+ */
+uint8_t sdlog_close(void) {
+  uint8_t res = SDLOG_SUCCESS;
+  uint32_t size;
+
+  if (!logging)
+    return SDLOG_ER_STATE;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    logging = 0;      /* the producers are stopped */
+  }
+  while (pending && res == SDLOG_SUCCESS)
+    res = log_flush();
+  if (fill_len && res == SDLOG_SUCCESS && next_sector < sector_count) {
+    memset(buffers[fill] + fill_len, 0, SD_BLOCK_SIZE - fill_len);
+    if (sd_write_next(buffers[fill]) == SD_SUCCESS) {
+      next_sector++;
+      stats.sectors++;
+    } else {
+      res = SDLOG_ER_CARD;
+    }
+  }
+  if (sd_write_close() != SD_SUCCESS && res == SDLOG_SUCCESS)
+    res = SDLOG_ER_CARD;
+
+  /* the card has the data, only the size is left to write */
+  size = (uint32_t)next_sector * SD_BLOCK_SIZE;
+  if (stats.bytes < size)
+    size = stats.bytes;
+  if (f_lseek(&log_file, size) != FR_OK || f_truncate(&log_file) != FR_OK) {
+    f_close(&log_file);
+    return SDLOG_ER_CLOSE;
+  }
+  if (f_close(&log_file) != FR_OK && res == SDLOG_SUCCESS)
+    res = SDLOG_ER_CLOSE;
+  return res;
+}
+
+/*
+ * Get the counters of the log open (or last closed)
+ */
+void sdlog_stats(SDLOG_STATS *s) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memcpy(s, (const void *)&stats, sizeof(*s));
+  }
+}
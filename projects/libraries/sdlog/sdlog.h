@@ -0,0 +1,34 @@
+/*
+ * File: include/sdlog.h
+ * SD card data logger Library Header File
+ */
+
+#ifndef SDLOG_H
+#define SDLOG_H
+
+#include <stdint.h>
+
+/* Error codes */
+#define SDLOG_SUCCESS        0x00
+#define SDLOG_ER_OPEN        0x01  /* f_open() / f_expand() failed: no contiguous space */
+#define SDLOG_ER_CARD        0x02  /* raw write to the card failed */
+#define SDLOG_ER_CLOSE       0x03  /* f_truncate() / f_close() failed */
+#define SDLOG_ER_STATE       0x04  /* no log open, or already open */
+#define SDLOG_ER_OVERRUN     0x05  /* both buffers full, data dropped */
+#define SDLOG_ER_FULL        0x06  /* the pre-allocated file is full, data dropped */
+
+typedef struct {
+  uint32_t bytes;          /* bytes accepted by sdlog_putc()/sdlog_write() */
+  uint32_t dropped;        /* bytes dropped: card too slow, or file full */
+  uint32_t sectors;        /* sectors written to the card */
+  uint16_t max_wait_ms;    /* longest time a full buffer waited for the card */
+} SDLOG_STATS;
+
+uint8_t     sdlog_open(const char *, uint32_t);
+uint8_t     sdlog_putc(uint8_t);
+uint8_t     sdlog_write(const uint8_t *, uint16_t);
+uint8_t     sdlog_task(void);
+uint8_t     sdlog_close(void);
+void        sdlog_stats(SDLOG_STATS *);
+
+#endif /* SDLOG_H */
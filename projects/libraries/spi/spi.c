@@ -1,5 +1,17 @@
 #include <avr/io.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <util/atomic.h>
+#if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__)
+#define SPI_USE_USI   // no SPI port: the USI in three-wire mode is the backend
+#include <util/delay_basic.h>
+#ifdef SPI_USE_MSPIM
+#error "SPI_BACKEND=mspim: the ATtiny25/45/85 have no USART"
+#endif
+#endif
+#if !defined(SPI_USE_MSPIM) && !defined(SPI_USE_USI)
+#define SPI_INLINE    // the SPDR functions are the inline versions of spi.h
+#endif
 #include "spi.h"
 
 /* this library is very dependant of the spi configuration used
@@ -30,7 +42,8 @@
 #define MISO_PIN    PB4  
 #define SCK_PIN     PB5  
 // CS for SD card shields - typically on Digital 4 (Port D)
-#if defined(SEEDSTUDIO_SDCARD_SHIELD)
+// D4 is XCK0, the MSPIM clock, so with the USART backend CS stays on D10 (HW_SS)
+#if defined(SEEDSTUDIO_SDCARD_SHIELD) && !defined(SPI_USE_MSPIM)
 #define CS_DDR      DDRD
 #define CS_PORT     PORTD
 #define CS_PIN      PD4   // D4
@@ -63,34 +76,272 @@
 #endif 
 
 
+#elif defined(SPI_USE_USI)
+// ATtiny25/45/85 - USI three-wire mode, the master pins are those of the USI:
+// DO is MOSI and DI is MISO (the ISP header names are the other way round, the
+// tiny is the slave when it is programmed). There is no hardware SS
+#define SPI_DDR     DDRB
+#define SPI_PORT    PORTB
+#define MISO_PIN    PB0   // DI
+#define MOSI_PIN    PB1   // DO
+#define SCK_PIN     PB2   // USCK
+#define CS_DDR      DDRB
+#define CS_PORT     PORTB
+#define CS_PIN      PB3
+
 #else
     #error "Unsupported MCU"
 #endif
 
+/* USART in SPI master mode (MSPIM) backend, build the library with SPI_BACKEND=mspim
+ * the transmit register is double buffered so bytes can be sent back to back
+ * without the gap the SPDR loop leaves between two bytes
+ *
+ * the device must then be wired to the USART pins instead of the SPI port:
+ *   ATmega328P:  USART0  XCK0 = PD4 (D4)   TXD0 = PD1 (D1) MOSI   RXD0 = PD0 (D0) MISO
+ *                the serial console is lost, CS is HW_SS (D10)
+ *   ATmega1284P: USART1  XCK1 = PD4        TXD1 = PD3 MOSI        RXD1 = PD2 MISO
+ *   ATmega2560:  USART1  XCK1 = PD5        TXD1 = PD3 (D18) MOSI  RXD1 = PD2 (D19) MISO
+ * the USART bit positions are the same for all the USARTs, the USART0 names are used
+ */
+#if defined(SPI_USE_MSPIM)
+#if defined(__AVR_ATmega328P__)
+#define MSPIM_UCSRA UCSR0A
+#define MSPIM_UCSRB UCSR0B
+#define MSPIM_UCSRC UCSR0C
+#define MSPIM_UBRR  UBRR0
+#define MSPIM_UDR   UDR0
+#define XCK_DDR     DDRD
+#define XCK_PIN     PD4
+#elif defined(__AVR_ATmega1284__) || defined(__AVR_ATmega1284P__)
+#define MSPIM_UCSRA UCSR1A
+#define MSPIM_UCSRB UCSR1B
+#define MSPIM_UCSRC UCSR1C
+#define MSPIM_UBRR  UBRR1
+#define MSPIM_UDR   UDR1
+#define XCK_DDR     DDRD
+#define XCK_PIN     PD4
+#elif defined(__AVR_ATmega2560__)
+#define MSPIM_UCSRA UCSR1A
+#define MSPIM_UCSRB UCSR1B
+#define MSPIM_UCSRC UCSR1C
+#define MSPIM_UBRR  UBRR1
+#define MSPIM_UDR   UDR1
+#define XCK_DDR     DDRD
+#define XCK_PIN     PD5
+#endif
+#define MSPIM_UCPOL 0   // UCPOLn
+#define MSPIM_UCPHA 1   // UCPHAn (UCSZn0 in UART mode)
+#define MSPIM_UDORD 2   // UDORDn (UCSZn1 in UART mode)
+#endif
+
+/* settings in use, kept by the setters so spi_select() only touches the
+ * registers when the device needs different ones */
+static uint8_t spi_enabled = 0;
+static uint8_t spi_config = SPI_MODE0 | SPI_MSB_FIRST;
+static uint8_t spi_divisor = 0;
+static SPI_DEVICE *volatile spi_bus_owner = NULL;
+
 void spi_cs_low(void) {
+#ifdef HW_SS_PIN
   SPI_PORT &= ~(1 << HW_SS_PIN);
+#endif
 #ifdef CS_PORT
   CS_PORT  &= ~(1 << CS_PIN);
 #endif
 }
 
 void spi_cs_high(void) {
+#ifdef HW_SS_PIN
   SPI_PORT |= (1 << HW_SS_PIN);
+#endif
 #ifdef CS_PORT
   CS_PORT  |= (1 << CS_PIN);
 #endif
 }
 
+#if defined(SPI_USE_MSPIM)
+
+/*
+ * Select the clock divisor
+ * in MSPIM mode the clock is F_CPU / (2 * (UBRR + 1)): any even divisor from 2
+ * odd divisors are rounded up so the bus is never clocked faster than asked
+ */
+void spi_set_divisor(uint8_t divisor) {
+  MSPIM_UBRR = (divisor > 2) ? (divisor + 1) / 2 - 1 : 0;
+  spi_divisor = spi_get_divisor();
+}
+
+/*
+ * Get the clock divisor currently in use
+ */
+uint8_t spi_get_divisor(void) {
+  uint16_t ubrr = MSPIM_UBRR;
+  
+  return (ubrr >= 127) ? 255 : (uint8_t)(2 * (ubrr + 1));
+}
+
+/*
+ * Get the divisor the hardware uses for a requested divisor
+ */
+static uint8_t spi_hw_divisor(uint8_t divisor) {
+  return (divisor > 254) ? 255 : (divisor + 1) & 0xFE;
+}
+
+void spi_set_mode(uint8_t xcpol, uint8_t xcpha) {
+  MSPIM_UCSRC &= ~((1 << MSPIM_UCPOL) | (1 << MSPIM_UCPHA));
+  if (xcpol) 
+    MSPIM_UCSRC |= (1 << MSPIM_UCPOL);
+  if (xcpha) 
+    MSPIM_UCSRC |= (1 << MSPIM_UCPHA);
+  spi_config = (spi_config & SPI_LSB_FIRST) | (xcpol ? 0x02 : 0) | (xcpha ? 0x01 : 0);
+}
+
+void spi_set_bit_order(uint8_t order) {
+  if (order == SPI_LSB_FIRST)
+    MSPIM_UCSRC |= (1 << MSPIM_UDORD);
+  else
+    MSPIM_UCSRC &= ~(1 << MSPIM_UDORD);
+  spi_config = (spi_config & 0x03) | (order & SPI_LSB_FIRST);
+}
+
+#elif defined(SPI_USE_USI)
+
+/* the USI has no clock generator, the clock is made by software:
+ * divisor 2 with CPHA=0 (modes 0 and 2): the datasheet fastest sequence, 16
+ *   unrolled USICR writes alternating a USCK toggle and a USICLK strobe
+ * other divisors and modes: USCK toggled by USITC in a loop until the 4-bit
+ *   counter overflows, the USI sampling the pin edge selected by USICS0;
+ *   about USI_EDGE_CYCLES per edge plus 3 cycles per _delay_loop_1() count,
+ *   so 4 and 8 are slowed down to 12
+ */
+#define USI_EDGE_CYCLES  6
+
+static uint8_t usi_fast = 0;     // unrolled strobes
+static uint8_t usi_delay = 0;    // _delay_loop_1() count per edge in the loop
+static uint8_t usi_clock = 0;    // USICR value written for each edge in the loop
+
+/*
+ * Get the _delay_loop_1() count per edge for a divisor
+ */
+static uint8_t usi_delay_count(uint8_t divisor) {
+  uint8_t half = (divisor + 1) / 2;
+
+  if (half <= USI_EDGE_CYCLES)
+    return 0;
+  half = (half - USI_EDGE_CYCLES + 2) / 3;
+  return (half > 41) ? 41 : half;
+}
+
+/*
+ * Get the divisor the hardware uses for a requested divisor
+ */
+static uint8_t spi_hw_divisor(uint8_t divisor) {
+  uint16_t hw;
+
+  if (divisor <= 2)
+    return 2;
+  hw = 2 * (3 * usi_delay_count(divisor) + USI_EDGE_CYCLES);
+  return (hw > 255) ? 255 : (uint8_t)hw;
+}
+
+/*
+ * Choose the transfer sequence for the divisor and mode in use
+ */
+static void usi_update(void) {
+  usi_fast = (spi_divisor == 2 && !(spi_config & 0x01));
+  // USICS0: the edge the USI shifts on, inverted by CPOL and by CPHA
+  usi_clock = (1 << USIWM0) | (1 << USICS1) | (1 << USICLK) | (1 << USITC);
+  if (((spi_config >> 1) ^ spi_config) & 0x01)
+    usi_clock |= (1 << USICS0);
+}
+
+/*
+ * Select the clock divisor, any divisor is possible but it is approximate
+ * above 2: see spi_hw_divisor(), the bus is never clocked faster than asked
+ */
+void spi_set_divisor(uint8_t divisor) {
+  spi_divisor = spi_hw_divisor(divisor);
+  usi_delay = (spi_divisor == 2) ? 0 : usi_delay_count(divisor);
+  usi_update();
+}
+
+/*
+ * Get the clock divisor currently in use
+ */
+uint8_t spi_get_divisor(void) {
+  return spi_divisor;
+}
+
+/*
+ * Set the mode, the USCK idle level is CPOL: USITC toggles the pin from there
+ */
+void spi_set_mode(uint8_t xcpol, uint8_t xcpha) {
+  if (xcpol)
+    SPI_PORT |= (1 << SCK_PIN);
+  else
+    SPI_PORT &= ~(1 << SCK_PIN);
+  spi_config = (spi_config & SPI_LSB_FIRST) | (xcpol ? 0x02 : 0) | (xcpha ? 0x01 : 0);
+  usi_update();
+}
+
+/*
+ * Set the bit order, the USI only shifts MSB first: LSB first bytes are
+ * reversed in software
+ */
+void spi_set_bit_order(uint8_t order) {
+  spi_config = (spi_config & 0x03) | (order & SPI_LSB_FIRST);
+}
+
+#else
+
+/*
+ * Get the divisor the hardware uses for a requested divisor
+ */
+static uint8_t spi_hw_divisor(uint8_t divisor) {
+  uint8_t hw = 2;
+
+  while (hw < divisor && hw < 128)
+    hw <<= 1;
+  return hw;
+}
+
+/*
+ * Select the hardware clock divisor
+ * the AVR SPI can divide F_CPU by 2, 4, 8, 16, 32, 64 or 128 (2, 8 and 32 need SPI2X)
+ * the smallest hardware divisor not lower than the requested one is used so the
+ * bus is never clocked faster than asked
+ */
 void spi_set_divisor(uint8_t divisor) {
-  uint8_t spr_bits = 0;
+  uint8_t spr_bits, spi2x;
   
   // Map divisor to AVR SPI clock select bits
-  if (divisor >= 128) spr_bits = 0x03;      // /128
-  else if (divisor >= 64) spr_bits = 0x02;  // /64
-  else if (divisor >= 16) spr_bits = 0x01;  // /16
-  else spr_bits = 0x00;                     // /4
+  if (divisor > 64)      { spr_bits = 0x03; spi2x = 0; }  // /128
+  else if (divisor > 32) { spr_bits = 0x02; spi2x = 0; }  // /64
+  else if (divisor > 16) { spr_bits = 0x02; spi2x = 1; }  // /32
+  else if (divisor > 8)  { spr_bits = 0x01; spi2x = 0; }  // /16
+  else if (divisor > 4)  { spr_bits = 0x01; spi2x = 1; }  // /8
+  else if (divisor > 2)  { spr_bits = 0x00; spi2x = 0; }  // /4
+  else                   { spr_bits = 0x00; spi2x = 1; }  // /2
+  
+  SPCR = (SPCR & 0xFC) | spr_bits;
+  if (spi2x)
+    SPSR |= (1 << SPI2X);
+  else
+    SPSR &= ~(1 << SPI2X);
+  spi_divisor = spi_hw_divisor(divisor);
+}
+
+/*
+ * Get the hardware clock divisor currently in use
+ */
+uint8_t spi_get_divisor(void) {
+  static const uint8_t spr_divisor[4] = { 4, 16, 64, 128 };
+  uint8_t divisor = spr_divisor[SPCR & 0x03];
   
-  SPCR = (SPCR & 0xFC) | (spr_bits & 0x03);
+  if (SPSR & (1 << SPI2X))
+    divisor >>= 1;
+  return divisor;
 }
 
 void spi_set_mode(uint8_t xcpol, uint8_t xcpha) {
@@ -99,14 +350,28 @@ void spi_set_mode(uint8_t xcpol, uint8_t xcpha) {
     SPCR |= (1 << CPOL);
   if (xcpha) 
     SPCR |= (1 << CPHA);
+  spi_config = (spi_config & SPI_LSB_FIRST) | (xcpol ? 0x02 : 0) | (xcpha ? 0x01 : 0);
 }
 
+void spi_set_bit_order(uint8_t order) {
+  if (order == SPI_LSB_FIRST)
+    SPCR |= (1 << DORD);
+  else
+    SPCR &= ~(1 << DORD);
+  spi_config = (spi_config & 0x03) | (order & SPI_LSB_FIRST);
+}
+
+#endif
+
 uint8_t spi_calculate_divisor(uint16_t frequency_khz) {
   const uint32_t cpu_khz = F_CPU / 1000;
-  uint16_t divisor = cpu_khz / frequency_khz;
+  uint32_t divisor;
   
+  if (frequency_khz == 0)
+    return 255;
+  divisor = (cpu_khz + frequency_khz - 1) / frequency_khz;  // round up: never faster than asked
   if (divisor > 255) divisor = 255;
-  if (divisor < 4) divisor = 4;
+  if (divisor < 2) divisor = 2;
   
   return (uint8_t)divisor;
 }
@@ -116,6 +381,316 @@ void spi_set_frequency_khz(uint16_t frequency) {
   spi_set_divisor(divisor);
 }
 
+/*
+ * Get the SPI clock currently in use in kHz
+ */
+uint16_t spi_get_frequency_khz(void) {
+  return (uint16_t)((F_CPU / 1000) / spi_get_divisor());
+}
+
+/*
+ * Register a device of the bus, the bus is initialized by the first one
+ * the CS pin is set high before it becomes an output so the device never
+ * sees a select glitch
+ * dev: device to fill, it must stay valid while the device is used
+ * cs_ddr, cs_port: CS port registers (&DDRB, &PORTB...), NULL for the board CS
+ * cs_pin: CS bit in the port
+ * mode: SPI_MODE0 to SPI_MODE3
+ * order: SPI_MSB_FIRST or SPI_LSB_FIRST
+ * max_khz: highest clock the device supports
+ */
+void spi_register(SPI_DEVICE *dev, volatile uint8_t *cs_ddr, volatile uint8_t *cs_port,
+                  uint8_t cs_pin, uint8_t mode, uint8_t order, uint16_t max_khz) {
+  dev->cs_port = cs_port;
+  dev->cs_mask = 1 << cs_pin;
+  dev->config = (mode & 0x03) | (order & SPI_LSB_FIRST);
+  dev->divisor = spi_hw_divisor(spi_calculate_divisor(max_khz));
+  dev->release = NULL;
+  if (!spi_enabled)
+    spi_init(128, 0, 0);
+  if (cs_port) {
+    *cs_port |= dev->cs_mask;
+    *cs_ddr |= dev->cs_mask;
+  }
+}
+
+/*
+ * Change the clock of a device, applied at once if it holds the bus
+ */
+void spi_set_device_khz(SPI_DEVICE *dev, uint16_t max_khz) {
+  dev->divisor = spi_hw_divisor(spi_calculate_divisor(max_khz));
+  if (spi_bus_owner == dev && dev->divisor != spi_divisor)
+    spi_set_divisor(dev->divisor);
+}
+
+/*
+ * Get the clock of a device in kHz
+ */
+uint16_t spi_get_device_khz(const SPI_DEVICE *dev) {
+  return (uint16_t)((F_CPU / 1000) / dev->divisor);
+}
+
+/*
+ * Take the bus for a device and apply its settings, CS is not changed
+ * (clocks sent with CS high, as the SD card power up sequence needs)
+ * the registers are only written when the settings in use differ
+ * a device that keeps the bus between calls (the SD card read stream) has a
+ * release hook, called here to give the bus back: never acquire from an interrupt
+ * Returns: 0 = success, SPI_ER_BUSY if another device holds the bus
+ */
+uint8_t spi_acquire(SPI_DEVICE *dev) {
+  SPI_DEVICE *owner = spi_bus_owner;
+
+  if (owner != NULL && owner != dev && owner->release != NULL)
+    owner->release();        // it ends its open transfer and deselects
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (spi_bus_owner != NULL && spi_bus_owner != dev)
+      return SPI_ER_BUSY;
+    spi_bus_owner = dev;
+  }
+  if (dev->config != spi_config) {
+    spi_set_mode(dev->config & 0x02, dev->config & 0x01);
+    spi_set_bit_order(dev->config & SPI_LSB_FIRST);
+  }
+  if (dev->divisor != spi_divisor)
+    spi_set_divisor(dev->divisor);
+  return SPI_SUCCESS;
+}
+
+/*
+ * Take the bus for a device, apply its settings and pull its CS low
+ * Returns: 0 = success, SPI_ER_BUSY if another device holds the bus
+ */
+uint8_t spi_select(SPI_DEVICE *dev) {
+  if (spi_acquire(dev) != SPI_SUCCESS)
+    return SPI_ER_BUSY;
+  if (dev->cs_port)
+    *dev->cs_port &= ~dev->cs_mask;
+  else
+    spi_cs_low();
+  return SPI_SUCCESS;
+}
+
+/*
+ * Set the CS of a device high and release the bus
+ */
+void spi_deselect(SPI_DEVICE *dev) {
+  if (dev->cs_port)
+    *dev->cs_port |= dev->cs_mask;
+  else
+    spi_cs_high();
+  if (spi_bus_owner == dev)
+    spi_bus_owner = NULL;
+}
+
+/*
+ * Get the device holding the bus
+ * Returns: NULL if the bus is free
+ */
+SPI_DEVICE *spi_owner(void) {
+  return spi_bus_owner;
+}
+
+#if defined(SPI_USE_MSPIM)
+
+void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
+#ifdef CS_DDR
+  CS_DDR |= (1 << CS_PIN);
+#endif 
+  SPI_DDR |= (1 << HW_SS_PIN);
+  SPI_PORT |= (1 << HW_SS_PIN);
+  
+  // the datasheet sequence: UBRR cleared, XCK output (master), MSPIM mode, enable, then baud rate
+  MSPIM_UBRR = 0;
+  XCK_DDR |= (1 << XCK_PIN);
+  MSPIM_UCSRC = (1 << UMSEL01) | (1 << UMSEL00);   // MSPIM, MSB first
+  MSPIM_UCSRB = (1 << RXEN0) | (1 << TXEN0);
+  spi_config = SPI_MSB_FIRST;
+  spi_enabled = 1;
+  
+  spi_set_mode(cpol, cpha);
+  spi_set_divisor(divisor);
+  spi_cs_high();
+}
+
+uint8_t spi_transfer(uint8_t data) {
+  while (!(MSPIM_UCSRA & (1 << UDRE0)));
+  MSPIM_UDR = data;
+  while (!(MSPIM_UCSRA & (1 << RXC0)));
+  return MSPIM_UDR;
+}
+
+void spi_begin_transfer(uint8_t data) {
+  while (!(MSPIM_UCSRA & (1 << UDRE0)));
+  MSPIM_UDR = data;
+}
+
+uint8_t spi_end_transfer(void) {
+  while (!(MSPIM_UCSRA & (1 << RXC0)));
+  return MSPIM_UDR;
+}
+
+/*
+ * Send a block, the received bytes are discarded
+ * the next byte is loaded as soon as the transmit buffer is free so the clock never stops
+ */
+void spi_write_block(const uint8_t *data, uint16_t len) {
+  if (!len)
+    return;                                // TXC would never be set
+  MSPIM_UCSRA = (1 << TXC0);               // clear the transmit complete flag
+  while (len--) {
+    while (!(MSPIM_UCSRA & (1 << UDRE0)));
+    MSPIM_UDR = *data++;
+  }
+  while (!(MSPIM_UCSRA & (1 << TXC0)));
+  while (MSPIM_UCSRA & (1 << RXC0))        // drop what was received meanwhile
+    (void)MSPIM_UDR;
+}
+
+/*
+ * Receive a block, 0xFF is sent for every byte
+ * two bytes are kept in flight: the next one is queued before the current one is read
+ */
+void spi_read_block(uint8_t *data, uint16_t len) {
+  if (!len)
+    return;
+  while (!(MSPIM_UCSRA & (1 << UDRE0)));
+  MSPIM_UDR = 0xFF;
+  while (--len) {
+    while (!(MSPIM_UCSRA & (1 << UDRE0)));
+    MSPIM_UDR = 0xFF;
+    while (!(MSPIM_UCSRA & (1 << RXC0)));
+    *data++ = MSPIM_UDR;
+  }
+  while (!(MSPIM_UCSRA & (1 << RXC0)));
+  *data = MSPIM_UDR;
+}
+
+/*
+ * Send len times the same byte, the received bytes are discarded
+ */
+void spi_fill(uint8_t value, uint16_t len) {
+  if (!len)
+    return;                                // TXC would never be set
+  MSPIM_UCSRA = (1 << TXC0);               // clear the transmit complete flag
+  while (len--) {
+    while (!(MSPIM_UCSRA & (1 << UDRE0)));
+    MSPIM_UDR = value;
+  }
+  while (!(MSPIM_UCSRA & (1 << TXC0)));
+  while (MSPIM_UCSRA & (1 << RXC0))        // drop what was received meanwhile
+    (void)MSPIM_UDR;
+}
+
+#elif defined(SPI_USE_USI)
+
+static uint8_t usi_pending;
+
+void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
+  CS_PORT |= (1 << CS_PIN);
+  CS_DDR |= (1 << CS_PIN);
+  SPI_DDR |= (1 << MOSI_PIN) | (1 << SCK_PIN);
+  SPI_DDR &= ~(1 << MISO_PIN);
+  SPI_PORT |= (1 << MISO_PIN);   // pull-up: a missing slave reads 0xFF
+  
+  USICR = (1 << USIWM0);         // three-wire mode, the clock is software
+  spi_config = SPI_MSB_FIRST;
+  spi_enabled = 1;
+  
+  spi_set_mode(cpol, cpha);
+  spi_set_divisor(divisor);
+  spi_cs_high();
+}
+
+/*
+ * Reverse the bits of a byte, for SPI_LSB_FIRST
+ */
+static uint8_t usi_reverse(uint8_t b) {
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+}
+
+/*
+ * Shift one byte, MSB first
+ * fast: each USICR write is one cycle, the bus runs at F_CPU/2
+ */
+static inline uint8_t usi_shift(uint8_t data) {
+  USIDR = data;
+  if (usi_fast) {
+    const uint8_t tick = (1 << USIWM0) | (1 << USITC);
+    const uint8_t tock = (1 << USIWM0) | (1 << USITC) | (1 << USICLK);
+    
+    USICR = tick; USICR = tock;    // MSB
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;
+    USICR = tick; USICR = tock;    // LSB
+  } else {
+    USISR = (1 << USIOIF);       // clear the flag and the counter
+    do {
+      USICR = usi_clock;
+      if (usi_delay)
+        _delay_loop_1(usi_delay);
+    } while (!(USISR & (1 << USIOIF)));
+  }
+  return USIDR;
+}
+
+uint8_t spi_transfer(uint8_t data) {
+  if (spi_config & SPI_LSB_FIRST)
+    return usi_reverse(usi_shift(usi_reverse(data)));
+  return usi_shift(data);
+}
+
+/*
+ * split transfer: the USI has no background shift, the byte is sent by
+ * spi_begin_transfer() and spi_end_transfer() only returns it
+ */
+void spi_begin_transfer(uint8_t data) {
+  usi_pending = spi_transfer(data);
+}
+
+uint8_t spi_end_transfer(void) {
+  return usi_pending;
+}
+
+/*
+ * Send a block, the received bytes are discarded
+ */
+void spi_write_block(const uint8_t *data, uint16_t len) {
+  if (spi_config & SPI_LSB_FIRST) {
+    while (len--)
+      usi_shift(usi_reverse(*data++));
+    return;
+  }
+  while (len--)
+    usi_shift(*data++);
+}
+
+/*
+ * Receive a block, 0xFF is sent for every byte
+ */
+void spi_read_block(uint8_t *data, uint16_t len) {
+  while (len--)
+    *data++ = spi_transfer(0xFF);
+}
+
+/*
+ * Send len times the same byte, the received bytes are discarded
+ */
+void spi_fill(uint8_t value, uint16_t len) {
+  if (spi_config & SPI_LSB_FIRST)
+    value = usi_reverse(value);
+  while (len--)
+    usi_shift(value);
+}
+
+#else
+
 void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
 #if defined(__AVR_ATmega2560__)
   // Enable SPI power on ATmega2560
@@ -138,6 +713,8 @@ void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
   // Enable SPI as Master
   SPCR &= ~((1 << DORD) | (1 << CPOL) | (1 << CPHA));
   SPCR = (1 << SPE) | (1 << MSTR);
+  spi_config = SPI_MSB_FIRST;
+  spi_enabled = 1;
   
   spi_set_mode(cpol, cpha);
   spi_set_divisor(divisor);
@@ -145,7 +722,45 @@ void spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha) {
 }
 
 uint8_t spi_transfer(uint8_t data) {
+  return spi_transfer_inline(data);
+}
+
+/*
+ * split transfer: spi_begin_transfer() starts shifting a byte and returns at once
+ * spi_end_transfer() waits for the end of the shift and returns the received byte
+ * the caller can do some work (crc, buffer store) while the byte is on the wire
+ */
+void spi_begin_transfer(uint8_t data) {
   SPDR = data;
+}
+
+uint8_t spi_end_transfer(void) {
   while (!(SPSR & (1 << SPIF)));
   return SPDR;
 }
+
+/*
+ * Send a block, the received bytes are discarded
+ * the next byte is fetched while the current one is shifted
+ */
+void spi_write_block(const uint8_t *data, uint16_t len) {
+  spi_write_block_inline(data, len);
+}
+
+/*
+ * Receive a block, 0xFF is sent for every byte
+ * the next byte is started as soon as the current one is read
+ */
+void spi_read_block(uint8_t *data, uint16_t len) {
+  spi_read_block_inline(data, len);
+}
+
+/*
+ * Send len times the same byte, the received bytes are discarded
+ * (SD card dummy clocks, display clear)
+ */
+void spi_fill(uint8_t value, uint16_t len) {
+  spi_fill_inline(value, len);
+}
+
+#endif
@@ -1,16 +1,162 @@
 #ifndef SPI_H
 #define SPI_H
 
+#include <stdint.h>
+
+/* Device modes: clock polarity and phase */
+#define SPI_MODE0       0x00  // CPOL=0 CPHA=0
+#define SPI_MODE1       0x01  // CPOL=0 CPHA=1
+#define SPI_MODE2       0x02  // CPOL=1 CPHA=0
+#define SPI_MODE3       0x03  // CPOL=1 CPHA=1
+
+/* Bit order */
+#define SPI_MSB_FIRST   0x00
+#define SPI_LSB_FIRST   0x04
+
+/* Error codes */
+#define SPI_SUCCESS     0x00
+#define SPI_ER_BUSY     0x01  // the bus is held by another device
+
+/* A device of the bus, filled by spi_register() */
+typedef struct {
+  volatile uint8_t *cs_port;  // NULL: the board CS, driven by spi_cs_low()/spi_cs_high()
+  uint8_t cs_mask;
+  uint8_t config;             // SPI_MODEx | SPI_MSB_FIRST or SPI_LSB_FIRST
+  uint8_t divisor;            // clock divisor, as applied by the hardware
+  void (*release)(void);      // set by the owner: ends a transfer left open, or NULL
+} SPI_DEVICE;
+
 // Function prototypes - same as your original API
 void    spi_init(uint8_t divisor, uint8_t cpol, uint8_t cpha);
 void    spi_set_divisor(uint8_t divisor);
+uint8_t spi_get_divisor(void);
 void    spi_set_mode(uint8_t cpol, uint8_t cpha);
+void    spi_set_bit_order(uint8_t order);
 void    spi_cs_low(void);
 void    spi_cs_high(void);
 uint8_t spi_calculate_divisor(uint16_t frequency_khz);
 void    spi_set_frequency_khz(uint16_t frequency);
+uint16_t spi_get_frequency_khz(void);
 uint8_t spi_transfer(uint8_t data);
+void    spi_begin_transfer(uint8_t data);
+uint8_t spi_end_transfer(void);
+void    spi_write_block(const uint8_t *data, uint16_t len);
+void    spi_read_block(uint8_t *data, uint16_t len);
+void    spi_fill(uint8_t value, uint16_t len);
 
-#endif // SPI_H
+// Device registry: several devices sharing the bus, each with its own settings
+void    spi_register(SPI_DEVICE *dev, volatile uint8_t *cs_ddr, volatile uint8_t *cs_port,
+                     uint8_t cs_pin, uint8_t mode, uint8_t order, uint16_t max_khz);
+void    spi_set_device_khz(SPI_DEVICE *dev, uint16_t max_khz);
+uint16_t spi_get_device_khz(const SPI_DEVICE *dev);
+uint8_t spi_acquire(SPI_DEVICE *dev);
+uint8_t spi_select(SPI_DEVICE *dev);
+void    spi_deselect(SPI_DEVICE *dev);
+SPI_DEVICE *spi_owner(void);
+
+/* Inline versions of the byte and block transfers for the SPDR backend
+ * define SPI_INLINE before including spi.h in a time critical file to get them
+ * the block loops are unrolled by 4: the loop test and the pointer update run
+ * while the byte is shifted, the next byte goes to SPDR as soon as SPIF is set
+ * they bypass the library, they can't be used with SPI_BACKEND=mspim nor with
+ * the USI of the ATtiny25/45/85
+ */
+#ifdef SPI_INLINE
+#if defined(SPI_USE_MSPIM) || defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__)
+#error "SPI_INLINE needs the SPDR backend"
+#endif
+#include <avr/io.h>
+
+#define SPI_WAIT()  do { } while (!(SPSR & (1 << SPIF)))
 
+static inline uint8_t spi_transfer_inline(uint8_t data) {
+  SPDR = data;
+  SPI_WAIT();
+  return SPDR;
+}
 
+/*
+ * Send a block, the received bytes are discarded
+ */
+static inline void spi_write_block_inline(const uint8_t *data, uint16_t len) {
+  uint8_t next;
+
+  if (!len)
+    return;
+  SPDR = *data++;
+  len--;
+  while (len >= 4) {
+    next = data[0]; SPI_WAIT(); SPDR = next;
+    next = data[1]; SPI_WAIT(); SPDR = next;
+    next = data[2]; SPI_WAIT(); SPDR = next;
+    next = data[3]; SPI_WAIT(); SPDR = next;
+    data += 4;
+    len -= 4;
+  }
+  while (len--) {
+    next = *data++;
+    SPI_WAIT();
+    SPDR = next;
+  }
+  SPI_WAIT();
+}
+
+/*
+ * Receive a block, 0xFF is sent for every byte
+ * SPDR is read and the next 0xFF sent at once, the store runs during the shift
+ * (the receive side of the SPI is double buffered)
+ */
+static inline void spi_read_block_inline(uint8_t *data, uint16_t len) {
+  uint8_t b0, b1, b2, b3;
+
+  if (!len)
+    return;
+  SPDR = 0xFF;
+  len--;
+  while (len >= 4) {
+    SPI_WAIT(); b0 = SPDR; SPDR = 0xFF;
+    SPI_WAIT(); b1 = SPDR; SPDR = 0xFF;
+    data[0] = b0;
+    data[1] = b1;
+    SPI_WAIT(); b2 = SPDR; SPDR = 0xFF;
+    SPI_WAIT(); b3 = SPDR; SPDR = 0xFF;
+    data[2] = b2;
+    data[3] = b3;
+    data += 4;
+    len -= 4;
+  }
+  while (len--) {
+    SPI_WAIT();
+    b0 = SPDR;
+    SPDR = 0xFF;
+    *data++ = b0;
+  }
+  SPI_WAIT();
+  *data = SPDR;
+}
+
+/*
+ * Send len times the same byte, the received bytes are discarded
+ */
+static inline void spi_fill_inline(uint8_t value, uint16_t len) {
+  if (!len)
+    return;
+  SPDR = value;
+  len--;
+  while (len >= 4) {
+    SPI_WAIT(); SPDR = value;
+    SPI_WAIT(); SPDR = value;
+    SPI_WAIT(); SPDR = value;
+    SPI_WAIT(); SPDR = value;
+    len -= 4;
+  }
+  while (len--) {
+    SPI_WAIT();
+    SPDR = value;
+  }
+  SPI_WAIT();
+}
+
+#endif // SPI_INLINE
+
+#endif // SPI_H
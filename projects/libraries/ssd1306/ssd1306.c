@@ -1,17 +1,24 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <avr/io.h>
 #include <util/delay.h>
 #include <i2c.h>
 #include <font-transform.h>
 #include <ssd1306.h>
 
+#ifdef HARDWARE_I2C
+// refresh in the background: the address window then the frame, queued to
+// the TWI interrupt, reused by the next refresh once done
+static uint8_t refresh_window[6];
+static I2C_TRANSACTION refresh_area;
+static I2C_TRANSACTION refresh_frame;
+#endif
 
 static void ssd1306_write(SSD1306 *display, const uint8_t *data, uint8_t size) {
   i2c_start();
   i2c_write(display->address << 1); 
-  for(uint8_t i = 0; i < size; i++) 
-    i2c_write(data[i]);
+  i2c_write_block(data, size);
   i2c_stop();
 }
 
@@ -200,9 +207,53 @@ void ssd1306_draw_string(SSD1306 *display, uint8_t x, uint8_t y,
     }
 }
 
+#ifdef HARDWARE_I2C
+
+/*
+ * Send the buffer to the display in the background, the function returns as
+ * soon as the transfer is queued: i2c_busy()/i2c_wait() tell when it is done.
+ * Drawing meanwhile is allowed, the part of the buffer not sent yet shows the
+ * new pixels. A new refresh first waits for the previous one
+ * with the interrupts disabled nothing would run the queue: the refresh is then
+ * sent before returning, as with the polled TWI
+ */
 void ssd1306_refresh(SSD1306 *display) {
-  uint16_t i;
+  if (refresh_area.status == I2C_PENDING || refresh_frame.status == I2C_PENDING)
+    i2c_wait();
+  refresh_window[0] = SSD1306_SET_COLUMN_ADDR;
+  refresh_window[1] = 0;
+  refresh_window[2] = display->width - 1;
+  refresh_window[3] = SSD1306_SET_PAGE_ADDR;
+  refresh_window[4] = 0;
+  refresh_window[5] = (display->height == 64) ? 7 : 3;
+  
+  refresh_area.address    = display->address;
+  refresh_area.header[0]  = SSD1306_COMMAND;     // a command stream
+  refresh_area.header_len = 1;
+  refresh_area.write      = refresh_window;
+  refresh_area.write_len  = sizeof(refresh_window);
+  refresh_area.read_len   = 0;
+  refresh_area.done       = NULL;
+  
+  refresh_frame.address    = display->address;
+  refresh_frame.header[0]  = SSD1306_DATA_CONTINUE;
+  refresh_frame.header_len = 1;
+  refresh_frame.write      = display->data;
+  refresh_frame.write_len  = display->data_size;
+  refresh_frame.read_len   = 0;
+  refresh_frame.done       = NULL;
   
+  while (i2c_submit(&refresh_area) != I2C_SUCCESS)
+    i2c_wait();     // the queue is full
+  while (i2c_submit(&refresh_frame) != I2C_SUCCESS)
+    i2c_wait();
+  if (!(SREG & (1 << SREG_I)))
+    i2c_wait();     // runs the transfers itself
+}
+
+#else
+
+void ssd1306_refresh(SSD1306 *display) {
   ssd1306_command(display, SSD1306_SET_COLUMN_ADDR);
   ssd1306_command(display, 0);   
   ssd1306_command(display, display->width - 1); 
@@ -218,10 +269,8 @@ void ssd1306_refresh(SSD1306 *display) {
   i2c_start();
   i2c_write(display->address << 1);
   i2c_write(SSD1306_DATA_CONTINUE);  // 0x40 - data mode
-  
-  for (i = 0; i < display->data_size; i++) {
-    i2c_write(display->data[i]);
-  }
-  
+  i2c_write_block(display->data, display->data_size);
   i2c_stop();
 }
+
+#endif
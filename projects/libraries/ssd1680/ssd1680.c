@@ -6,6 +6,7 @@
 #include <font-transform.h>
 #include <avr/pgmspace.h>
 #include <string.h>
+#include <spi.h>
 #include <ssd1680.h>
 
 // SSD1680 commands
@@ -42,37 +43,22 @@ static const uint8_t lut_full_update[] PROGMEM = {
     0x0,  0x0,  0x0,  0x0,  0x0,
 };
 
-// Pin control macros
-#define CS_LOW()   SSD1680_CS_PORT &= ~(1 << SSD1680_CS_PIN)
-#define CS_HIGH()  SSD1680_CS_PORT |= (1 << SSD1680_CS_PIN)
+// The display on the SPI bus: mode 0, MSB first, up to 20 MHz for writes
+#define SSD1680_SPI_KHZ 20000
+static SPI_DEVICE ssd1680_spi;
+static uint8_t writing;  // selected by ssd1680_start_write()
+
+// Pin control macros, CS_LOW() returns SPI_ER_BUSY while another device holds the bus
+#define CS_LOW()   spi_select(&ssd1680_spi)
+#define CS_HIGH()  spi_deselect(&ssd1680_spi)
 #define DC_LOW()   SSD1680_DC_PORT &= ~(1 << SSD1680_DC_PIN)
 #define DC_HIGH()  SSD1680_DC_PORT |= (1 << SSD1680_DC_PIN)
 #define RST_LOW()  SSD1680_RST_PORT &= ~(1 << SSD1680_RST_PIN)
 #define RST_HIGH() SSD1680_RST_PORT |= (1 << SSD1680_RST_PIN)
 #define IS_BUSY()  (SSD1680_BUSY_PIN & (1 << SSD1680_BUSY_BIT))
 
-// Initialize SPI
-static void spi_init(void) {
-#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
-  DDRB |= (1 << PB3) | (1 << PB5);
-  SPCR = (1 << SPE) | (1 << MSTR);
-  SPSR |= (1 << SPI2X);
-#elif defined(__AVR_ATmega1284P__)
-  DDRB |= (1 << PB5) | (1 << PB7);
-  SPCR = (1 << SPE) | (1 << MSTR);
-  SPSR |= (1 << SPI2X);
-#elif defined(__AVR_ATmega2560__)
-  DDRB |= (1 << PB2) | (1 << PB1);
-  SPCR = (1 << SPE) | (1 << MSTR);
-  SPSR |= (1 << SPI2X);
-#endif
-}
-
-// Send byte via SPI
-static void spi_send(uint8_t data) {
-    SPDR = data;
-    while (!(SPSR & (1 << SPIF)));
-}
+// Stop a sequence at the first transfer the bus refused
+#define CHECK(x)   do { if ((x) != SPI_SUCCESS) return SPI_ER_BUSY; } while (0)
 
 // Wait for display not busy
 static void wait_busy(void) {
@@ -84,20 +70,32 @@ static void wait_busy(void) {
   }
 }
 
-// Send command
-void send_command(uint8_t cmd) {
+// Send command, nothing is sent while another device holds the bus
+uint8_t send_command(uint8_t cmd) {
   DC_LOW();
-  CS_LOW();
-  spi_send(cmd);
+  CHECK(CS_LOW());
+  spi_transfer(cmd);
+  CS_HIGH();
+  return SPI_SUCCESS;
+}
+
+// Send data, nothing is sent while another device holds the bus
+uint8_t send_data(uint8_t data) {
+  DC_HIGH();
+  CHECK(CS_LOW());
+  spi_transfer(data);
   CS_HIGH();
+  return SPI_SUCCESS;
 }
 
-// Send data
-void send_data(uint8_t data) {
+// Send a command and fill the RAM it selects with a byte
+static uint8_t fill_ram(uint8_t cmd, uint8_t value, uint16_t len) {
+  CHECK(send_command(cmd));
   DC_HIGH();
-  CS_LOW();
-  spi_send(data);
+  CHECK(CS_LOW());
+  spi_fill(value, len);
   CS_HIGH();
+  return SPI_SUCCESS;
 }
 
 // Hardware reset
@@ -111,154 +109,141 @@ static void reset(void) {
 }
 
 // Set memory pointer
-static void set_memory_pointer(uint8_t x, uint8_t y) {
-  send_command(CMD_SET_RAM_X_ADDRESS_COUNTER);
-  send_data(x);
+static uint8_t set_memory_pointer(uint8_t x, uint8_t y) {
+  CHECK(send_command(CMD_SET_RAM_X_ADDRESS_COUNTER));
+  CHECK(send_data(x));
   
-  send_command(CMD_SET_RAM_Y_ADDRESS_COUNTER);
-  send_data(y);
-  send_data(y >> 8);
+  CHECK(send_command(CMD_SET_RAM_Y_ADDRESS_COUNTER));
+  CHECK(send_data(y));
+  return send_data(y >> 8);
 }
 
-void ssd1680_set_data_entry_mode(uint8_t mode) {
-  send_command(CMD_DATA_ENTRY_MODE);
-  send_data(mode);
+uint8_t ssd1680_set_data_entry_mode(uint8_t mode) {
+  CHECK(send_command(CMD_DATA_ENTRY_MODE));
+  return send_data(mode);
 }
 
 // Initialize display - Waveshare V4 specific
-void ssd1680_init(void) {
+uint8_t ssd1680_init(void) {
   // Setup pins
-  SSD1680_CS_DDR |= (1 << SSD1680_CS_PIN);
   SSD1680_DC_DDR |= (1 << SSD1680_DC_PIN);
   SSD1680_RST_DDR |= (1 << SSD1680_RST_PIN);
   SSD1680_BUSY_DDR &= ~(1 << SSD1680_BUSY_BIT);
   
-  CS_HIGH();
-  
-  spi_init();
+  spi_register(&ssd1680_spi, &SSD1680_CS_DDR, &SSD1680_CS_PORT, SSD1680_CS_PIN,
+               SPI_MODE0, SPI_MSB_FIRST, SSD1680_SPI_KHZ);
   reset();
   wait_busy();
   
   // Software reset
-  send_command(CMD_SW_RESET);
+  CHECK(send_command(CMD_SW_RESET));
   wait_busy();
   
   // Driver output control - 250 lines
-  send_command(CMD_DRIVER_OUTPUT_CONTROL);
-  send_data((SSD1680_HEIGHT - 1) & 0xFF);        // 249 = 0xF9
-  send_data(((SSD1680_HEIGHT - 1) >> 8) & 0xFF); // 0x00
-  send_data(0x00);
+  CHECK(send_command(CMD_DRIVER_OUTPUT_CONTROL));
+  CHECK(send_data((SSD1680_HEIGHT - 1) & 0xFF));        // 249 = 0xF9
+  CHECK(send_data(((SSD1680_HEIGHT - 1) >> 8) & 0xFF)); // 0x00
+  CHECK(send_data(0x00));
   
   // Data entry mode: X increment, Y increment
-  send_command(CMD_DATA_ENTRY_MODE);
-  send_data(0x03);
+  CHECK(send_command(CMD_DATA_ENTRY_MODE));
+  CHECK(send_data(0x03));
   
   // Set RAM X address (0-15 for 128 pixels, only 122 used)
-  send_command(CMD_SET_RAM_X_ADDRESS_START_END);
-  send_data(0x00);
-  send_data(0x0F);  // 15 = 0x0F
+  CHECK(send_command(CMD_SET_RAM_X_ADDRESS_START_END));
+  CHECK(send_data(0x00));
+  CHECK(send_data(0x0F));  // 15 = 0x0F
   
   // Set RAM Y address (0-249 for 250 lines)
-  send_command(CMD_SET_RAM_Y_ADDRESS_START_END);
-  send_data(0x00);
-  send_data(0x00);
-  send_data((SSD1680_HEIGHT - 1) & 0xFF);        // 249 = 0xF9
-  send_data(((SSD1680_HEIGHT - 1) >> 8) & 0xFF); // 0x00
+  CHECK(send_command(CMD_SET_RAM_Y_ADDRESS_START_END));
+  CHECK(send_data(0x00));
+  CHECK(send_data(0x00));
+  CHECK(send_data((SSD1680_HEIGHT - 1) & 0xFF));        // 249 = 0xF9
+  CHECK(send_data(((SSD1680_HEIGHT - 1) >> 8) & 0xFF)); // 0x00
   
   // Border waveform
-  send_command(0x3C);
-  send_data(0x05);
+  CHECK(send_command(0x3C));
+  CHECK(send_data(0x05));
   
   // Temperature sensor
-  send_command(0x18);
-  send_data(0x80);
+  CHECK(send_command(0x18));
+  CHECK(send_data(0x80));
   
   // Display update control
-  send_command(0x22);
-  send_data(0xB1);
-  send_command(0x20);
+  CHECK(send_command(0x22));
+  CHECK(send_data(0xB1));
+  CHECK(send_command(0x20));
   wait_busy();
   
   // Load LUT
-  send_command(CMD_WRITE_LUT_REGISTER);
+  CHECK(send_command(CMD_WRITE_LUT_REGISTER));
   for (uint8_t i = 0; i < sizeof(lut_full_update); i++) {
-    send_data(pgm_read_byte(&lut_full_update[i]));
+    CHECK(send_data(pgm_read_byte(&lut_full_update[i])));
   }
+  return SPI_SUCCESS;
 }
 
 // Clear display
-void ssd1680_clear(void) {
-  set_memory_pointer(0, 0);
-  
-  send_command(CMD_WRITE_RAM_BW);
-  DC_HIGH();
-  CS_LOW();
-  
-  for (uint16_t i = 0; i < SSD1680_BUFFER_SIZE; i++) {
-    spi_send(0xFF);
-  }
-  
-  CS_HIGH();
+uint8_t ssd1680_clear(void) {
+  CHECK(set_memory_pointer(0, 0));
+  return fill_ram(CMD_WRITE_RAM_BW, 0xFF, SSD1680_BUFFER_SIZE);  // White
 }
 
-void ssd1680_fill_black(void) {
-  set_memory_pointer(0, 0);
-  send_command(CMD_WRITE_RAM_BW);
-  DC_HIGH();
-  CS_LOW();
-  
-  for (uint16_t i = 0; i < SSD1680_BUFFER_SIZE; i++) {
-    spi_send(0x00);  // Black
-  }
-  CS_HIGH();
+uint8_t ssd1680_fill_black(void) {
+  CHECK(set_memory_pointer(0, 0));
+  return fill_ram(CMD_WRITE_RAM_BW, 0x00, SSD1680_BUFFER_SIZE);  // Black
 }
 
-// Start write to BW layer
-void ssd1680_start_write(void) {
-  set_memory_pointer(0, 0);
-  send_command(CMD_WRITE_RAM_BW);
+// Start write to BW layer, the display keeps the bus until ssd1680_end_write()
+uint8_t ssd1680_start_write(void) {
+  CHECK(set_memory_pointer(0, 0));
+  CHECK(send_command(CMD_WRITE_RAM_BW));
   DC_HIGH();
-  CS_LOW();
+  CHECK(CS_LOW());
+  writing = 1;
+  return SPI_SUCCESS;
 }
 
-// Write byte
+// Write byte, dropped if ssd1680_start_write() failed
 void ssd1680_write_byte(uint8_t data) {
-  spi_send(data);
+  if (writing)
+    spi_transfer(data);
 }
 
 // End write
 void ssd1680_end_write(void) {
-  CS_HIGH();
+  if (writing) {
+    CS_HIGH();
+    writing = 0;
+  }
 }
 
 // Write byte at specific position
-void ssd1680_write_byte_at(uint8_t x_pixel, uint8_t y, uint8_t data) {
+uint8_t ssd1680_write_byte_at(uint8_t x_pixel, uint8_t y, uint8_t data) {
   uint8_t x_byte = x_pixel / 8;
   
-  set_memory_pointer(x_byte, y);
-  send_command(CMD_WRITE_RAM_BW);
-  DC_HIGH();
-  CS_LOW();
-  spi_send(data);
-  CS_HIGH();
+  CHECK(set_memory_pointer(x_byte, y));
+  CHECK(send_command(CMD_WRITE_RAM_BW));
+  return send_data(data);
 }
 
 // Refresh display
-void ssd1680_refresh(void) {
-  send_command(CMD_DISPLAY_UPDATE_CONTROL_2);
-  send_data(0xF7);
+uint8_t ssd1680_refresh(void) {
+  CHECK(send_command(CMD_DISPLAY_UPDATE_CONTROL_2));
+  CHECK(send_data(0xF7));
   
-  send_command(CMD_MASTER_ACTIVATION);
+  CHECK(send_command(CMD_MASTER_ACTIVATION));
   wait_busy();
+  return SPI_SUCCESS;
 }
 
 // Sleep mode
-void ssd1680_sleep(void) {
-  send_command(CMD_DEEP_SLEEP_MODE);
-  send_data(0x01);
+uint8_t ssd1680_sleep(void) {
+  CHECK(send_command(CMD_DEEP_SLEEP_MODE));
+  return send_data(0x01);
 }
 
-void ssd1680_draw_block8x8(SSD1680 *display, uint8_t x_pixel, uint8_t y_pixel, const uint8_t *block, uint8_t color) {
+uint8_t ssd1680_draw_block8x8(SSD1680 *display, uint8_t x_pixel, uint8_t y_pixel, const uint8_t *block, uint8_t color) {
   (void)display;
   
   // x_pixel: pixel position (convert to byte)
@@ -282,12 +267,13 @@ void ssd1680_draw_block8x8(SSD1680 *display, uint8_t x_pixel, uint8_t y_pixel, c
     }
     
     // Write byte at position
-    ssd1680_write_byte_at(x_byte * 8, y_pixel + col, byte);
+    CHECK(ssd1680_write_byte_at(x_byte * 8, y_pixel + col, byte));
   }
+  return SPI_SUCCESS;
 }
 
 
-void ssd1680_draw_string(SSD1680 *display, uint8_t row, uint8_t col,
+uint8_t ssd1680_draw_string(SSD1680 *display, uint8_t row, uint8_t col,
                          const uint8_t *font,
                          uint8_t (*ascii_to_index)(char),
                          uint8_t double_width, uint8_t double_height,
@@ -331,7 +317,7 @@ void ssd1680_draw_string(SSD1680 *display, uint8_t row, uint8_t col,
 	    byte = ~byte;
 	  }
           
-	  ssd1680_write_byte_at((x_byte + bx) * 8, cursor_x + by * 8 + col_offset, byte);
+	  CHECK(ssd1680_write_byte_at((x_byte + bx) * 8, cursor_x + by * 8 + col_offset, byte));
 	}
       }
     }
@@ -340,4 +326,5 @@ void ssd1680_draw_string(SSD1680 *display, uint8_t row, uint8_t col,
     cursor_x += char_height;
     s++;
   }
+  return SPI_SUCCESS;
 }
@@ -4,6 +4,7 @@
 #include <avr/io.h>
 #include <util/delay.h>
 #include <stdint.h>
+#include <spi.h>
 
 // Pin definitions
 #define SSD1680_CS_PORT    PORTB
@@ -39,20 +40,23 @@ typedef struct {
 } SSD1680;
 
 // API functions
-void ssd1680_init(void);
-void ssd1680_clear(void);
-void ssd1680_fill_black(void);
-void ssd1680_start_write(void);
+// The display is a device of the shared SPI bus: the functions returning a status
+// give SPI_SUCCESS, or SPI_ER_BUSY when another device holds the bus, the rest of
+// the sequence is then not sent
+uint8_t ssd1680_init(void);
+uint8_t ssd1680_clear(void);
+uint8_t ssd1680_fill_black(void);
+uint8_t ssd1680_start_write(void);
 void ssd1680_write_byte(uint8_t data);
 void ssd1680_end_write(void);
-void ssd1680_write_byte_at(uint8_t x_pixel, uint8_t y, uint8_t data);
-void ssd1680_refresh(void);
-void ssd1680_sleep(void);
-void send_command(uint8_t);
-void send_data(uint8_t);
-void ssd1680_set_data_entry_mode(uint8_t mode);
-void ssd1680_draw_block8x8(SSD1680 *, uint8_t, uint8_t, const uint8_t *, uint8_t);
-void ssd1680_draw_string(SSD1680 *, uint8_t, uint8_t, const uint8_t *, uint8_t (*)(char), uint8_t, uint8_t, uint8_t, uint8_t, uint8_t,  const char *);
+uint8_t ssd1680_write_byte_at(uint8_t x_pixel, uint8_t y, uint8_t data);
+uint8_t ssd1680_refresh(void);
+uint8_t ssd1680_sleep(void);
+uint8_t send_command(uint8_t);
+uint8_t send_data(uint8_t);
+uint8_t ssd1680_set_data_entry_mode(uint8_t mode);
+uint8_t ssd1680_draw_block8x8(SSD1680 *, uint8_t, uint8_t, const uint8_t *, uint8_t);
+uint8_t ssd1680_draw_string(SSD1680 *, uint8_t, uint8_t, const uint8_t *, uint8_t (*)(char), uint8_t, uint8_t, uint8_t, uint8_t, uint8_t,  const char *);
 
 
 #endif
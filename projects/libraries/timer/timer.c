@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdint.h>
 #include <util/delay.h>
 #include "timer.h"
@@ -203,3 +204,96 @@ void timer_delay_ms(unsigned int milliseconds) {
         timer_delay_ticks((unsigned int)adjusted_ticks);
 }
 
+#if defined(TCCR2A)
+/*
+ * Millisecond clock on Timer2 (CTC mode, one interrupt per millisecond)
+ * Timer1 is restarted by every delay, the clock is kept on Timer2 so it can
+ * measure long operations while the delays and timer_start() are still used
+ * with the interrupts disabled the clock is polled: timer_millis() and
+ * timer_micros() count a pending compare match themselves. A poll is needed
+ * every millisecond, the ticks missed meanwhile make the clock late (the
+ * timeouts measured with it last longer, never shorter)
+ */
+// the smallest prescaler whose millisecond count fits the 8-bit OCR2A
+#if F_CPU / 64 / 1000 <= 256
+#define CLOCK_PRESCALER  64
+#define CLOCK_CS         (1 << CS22)                    // clk/64
+#elif F_CPU / 128 / 1000 <= 256
+#define CLOCK_PRESCALER  128
+#define CLOCK_CS         ((1 << CS22) | (1 << CS20))    // clk/128, 20MHz: 155 (+0.16%)
+#else
+#define CLOCK_PRESCALER  256
+#define CLOCK_CS         ((1 << CS22) | (1 << CS21))    // clk/256
+#endif
+#define CLOCK_TOP        ((F_CPU / CLOCK_PRESCALER + 500) / 1000 - 1)   // 249 at 16MHz
+#if CLOCK_TOP > 255
+#error "F_CPU too high for the Timer2 millisecond clock"
+#endif
+
+static volatile uint32_t clock_ms = 0;
+
+ISR(TIMER2_COMPA_vect) {
+    clock_ms++;
+}
+
+/*
+ * Count a compare match the interrupt can't serve, interrupts disabled
+ */
+static inline void clock_poll(uint8_t sreg) {
+    if (!(sreg & (1 << SREG_I)) && (TIFR2 & (1 << OCF2A))) {
+        TIFR2 = (1 << OCF2A);
+        clock_ms++;
+    }
+}
+
+/*
+ * Start the millisecond clock, the interrupts are left as they are
+ * the clock is never reset once running: several libraries can start it and
+ * measure their own intervals as differences of timer_millis()
+ */
+void timer_clock_start(void) {
+    if (TIMSK2 & (1 << OCIE2A))
+        return;
+    TCCR2B = 0;
+    TCNT2  = 0;
+    OCR2A  = CLOCK_TOP;
+    TCCR2A = (1 << WGM21);          // CTC, TOP = OCR2A
+    TCCR2B = CLOCK_CS;
+    TIFR2  = (1 << OCF2A);
+    TIMSK2 |= (1 << OCIE2A);
+    clock_ms = 0;
+}
+
+/*
+ * Milliseconds elapsed since the first timer_clock_start()
+ */
+uint32_t timer_millis(void) {
+    uint32_t ms;
+    uint8_t sreg = SREG;
+    
+    cli();
+    clock_poll(sreg);
+    ms = clock_ms;
+    SREG = sreg;
+    return ms;
+}
+
+/*
+ * Microseconds elapsed since the first timer_clock_start() (resolution 4us at 16MHz)
+ */
+uint32_t timer_micros(void) {
+    uint32_t ms;
+    uint8_t count;
+    uint8_t sreg = SREG;
+    
+    cli();
+    clock_poll(sreg);
+    ms = clock_ms;
+    count = TCNT2;
+    // the counter wrapped but the interrupt is not served yet
+    if ((TIFR2 & (1 << OCF2A)) && count < CLOCK_TOP)
+        ms++;
+    SREG = sreg;
+    return ms * 1000UL + (uint32_t)count * 1000UL / (CLOCK_TOP + 1);
+}
+#endif
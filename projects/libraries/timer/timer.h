@@ -18,5 +18,10 @@ uint32_t timer_get_frequency_hz(void);
 uint32_t timer_get_ticks_per_ms(void);
 uint16_t timer_get_ticks_per_us(void);
 
+// Millisecond clock on Timer2, runs on interrupts or polled when they are disabled
+void     timer_clock_start(void);
+uint32_t timer_millis(void);
+uint32_t timer_micros(void);
+
 #endif // TIMER_H
 
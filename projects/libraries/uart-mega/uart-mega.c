@@ -72,10 +72,10 @@ void uart_read_block(uint8_t *buffer, uint8_t length) {
   }
 }
 
-// Write a fixed block of data
-void uart_write_block(const uint8_t *buffer, uint8_t length) {
-  for (uint8_t i = 0; i < length; i++) {
-    uart_putc(buffer[i]);
+// Write a block of data as is (up to a sector, for f_forward())
+void uart_write_block(const uint8_t *buffer, uint16_t length) {
+  while (length--) {
+    uart_putc(*buffer++);
   }
 }
 
@@ -8,7 +8,7 @@ char    uart_getc(void);
 uint8_t uart_available(void);
 void    uart_puts(const char *);
 void    uart_read_block(uint8_t *, uint8_t);
-void    uart_read_block(uint8_t *, uint8_t);
+void    uart_write_block(const uint8_t *, uint16_t);  // Raw bytes, no LF to CRLF
 void    uart_set_echo(uint8_t);  // Enable/disable local echo
 void    uart_console();
 void    uart_restore();
@@ -0,0 +1,278 @@
+/*
+ * SD card throughput benchmark
+ * Supports ATmega1284P/ATmega2560
+ *
+ * measures on a FAT formatted card:
+ *   - raw sequential and random read/write throughput at each SPI divisor
+ *   - the latency histogram of CMD17/CMD24 (one block) and CMD18/CMD25 (BENCH_BLOCKS blocks)
+ *   - f_read/f_write throughput for several buffer sizes
+ *
+ * the raw tests run inside a contiguous file allocated with f_expand() so
+ * nothing else on the card is overwritten.
+ *
+ * the report is printed on the serial port, one record per line:
+ *   <record>,<key>=<value>,<key>=<value>...
+ * records: info, raw, hist, fatfs, error and end. throughputs are in bytes/s,
+ * times in ms, latencies in us.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <uart-mega.h>
+#include <spi.h>
+#include <sdcard.h>
+#include <timer.h>
+#include "ff.h"
+
+#if defined(__AVR_ATmega1284P__)
+#define BENCH_BLOCKS       8          /* blocks per multi-block transfer: 4KB buffer */
+#else
+#define BENCH_BLOCKS       4          /* ATmega2560: 8KB of SRAM, 2KB buffer */
+#endif
+#define BENCH_FILE         "SDBENCH.BIN"
+#define BENCH_AREA       512          /* blocks of the raw test area (256KB) */
+#define RANDOM_OPS        64          /* single block accesses of the random tests */
+#define FATFS_FILE        "SDBENCH.DAT"
+#define FATFS_SIZE    131072UL        /* bytes written then read by the f_write/f_read tests */
+#define HIST_BUCKETS      10          /* latency buckets: <128us, <256us ... >=32768us */
+#define HIST_BASE_US     128
+
+static uint8_t buffer[BENCH_BLOCKS * SD_BLOCK_SIZE];
+static uint16_t hist[4][HIST_BUCKETS];  /* CMD17, CMD24, CMD18, CMD25 */
+static const uint8_t hist_cmd[4] = { 17, 24, 18, 25 };
+static const uint8_t divisors[] = { 2, 4, 8, 16, 32 };
+static uint32_t seed = 1;
+
+#if !FF_FS_READONLY && !FF_FS_NORTC
+DWORD get_fattime(void) {
+  return ((DWORD)(FF_NORTC_YEAR - 1980) << 25) | ((DWORD)FF_NORTC_MON << 21) | ((DWORD)FF_NORTC_MDAY << 16);
+}
+#endif
+
+/* Linear congruential generator for the random block numbers */
+static uint16_t bench_random(uint16_t range) {
+  seed = seed * 1103515245UL + 12345;
+  return (uint16_t)((seed >> 16) % range);
+}
+
+/* Add a latency to a histogram, buckets double from HIST_BASE_US */
+static void hist_add(uint8_t cmd, uint32_t us) {
+  uint8_t bucket = 0;
+
+  while (bucket < HIST_BUCKETS - 1 && us >= ((uint32_t)HIST_BASE_US << bucket))
+    bucket++;
+  hist[cmd][bucket]++;
+}
+
+static void print_raw(const char *test, uint8_t divisor, uint32_t bytes, uint32_t us) {
+  printf("raw,div=%u,khz=%u,test=%s,bytes=%lu,ms=%lu,bps=%lu\n",
+	 divisor, spi_get_device_khz(&sd_spi), test, (unsigned long)bytes, (unsigned long)(us / 1000),
+	 (unsigned long)(us ? (uint64_t)bytes * 1000000UL / us : 0));
+}
+
+static void print_error(const char *test, uint8_t res) {
+  printf("error,test=%s,code=0x%02X,text=%s\n", test, res, sd_error_string(res));
+}
+
+/*
+ * Raw tests at the current SPI clock
+ * lba: first block of the test area
+ * record: true to fill the latency histograms
+ */
+static uint8_t bench_raw(LBA_t lba, uint8_t divisor, uint8_t record) {
+  uint32_t start, us, total;
+  uint16_t i;
+  uint8_t res;
+
+  /* sequential single block: CMD17 */
+  total = 0;
+  for (i = 0; i < BENCH_AREA; i++) {
+    start = timer_micros();
+    if ((res = sd_read(lba + i, buffer)) != SD_SUCCESS) {
+      print_error("seq_read", res);
+      return res;
+    }
+    us = timer_micros() - start;
+    total += us;
+    if (record)
+      hist_add(0, us);
+  }
+  print_raw("seq_read", divisor, (uint32_t)BENCH_AREA * SD_BLOCK_SIZE, total);
+
+  /* sequential multi block: CMD18 */
+  total = 0;
+  for (i = 0; i < BENCH_AREA; i += BENCH_BLOCKS) {
+    start = timer_micros();
+    if ((res = sd_read_multi(lba + i, BENCH_BLOCKS, buffer)) != SD_SUCCESS) {
+      print_error("seq_read_multi", res);
+      return res;
+    }
+    us = timer_micros() - start;
+    total += us;
+    if (record)
+      hist_add(2, us);
+  }
+  print_raw("seq_read_multi", divisor, (uint32_t)BENCH_AREA * SD_BLOCK_SIZE, total);
+
+  /* random single block read */
+  total = 0;
+  for (i = 0; i < RANDOM_OPS; i++) {
+    start = timer_micros();
+    if ((res = sd_read(lba + bench_random(BENCH_AREA), buffer)) != SD_SUCCESS) {
+      print_error("rand_read", res);
+      return res;
+    }
+    total += timer_micros() - start;
+  }
+  print_raw("rand_read", divisor, (uint32_t)RANDOM_OPS * SD_BLOCK_SIZE, total);
+
+  /* sequential single block: CMD24, waits for the end of programming */
+  memset(buffer, 0xA5, sizeof(buffer));
+  total = 0;
+  for (i = 0; i < BENCH_AREA; i++) {
+    start = timer_micros();
+    if ((res = sd_write(lba + i, buffer)) != SD_SUCCESS) {
+      print_error("seq_write", res);
+      return res;
+    }
+    us = timer_micros() - start;
+    total += us;
+    if (record)
+      hist_add(1, us);
+  }
+  print_raw("seq_write", divisor, (uint32_t)BENCH_AREA * SD_BLOCK_SIZE, total);
+
+  /* sequential multi block: ACMD23 + CMD25 */
+  total = 0;
+  for (i = 0; i < BENCH_AREA; i += BENCH_BLOCKS) {
+    start = timer_micros();
+    if ((res = sd_write_multi(lba + i, BENCH_BLOCKS, buffer)) != SD_SUCCESS) {
+      print_error("seq_write_multi", res);
+      return res;
+    }
+    us = timer_micros() - start;
+    total += us;
+    if (record)
+      hist_add(3, us);
+  }
+  print_raw("seq_write_multi", divisor, (uint32_t)BENCH_AREA * SD_BLOCK_SIZE, total);
+
+  /* random single block write */
+  total = 0;
+  for (i = 0; i < RANDOM_OPS; i++) {
+    start = timer_micros();
+    if ((res = sd_write(lba + bench_random(BENCH_AREA), buffer)) != SD_SUCCESS) {
+      print_error("rand_write", res);
+      return res;
+    }
+    total += timer_micros() - start;
+  }
+  print_raw("rand_write", divisor, (uint32_t)RANDOM_OPS * SD_BLOCK_SIZE, total);
+  return SD_SUCCESS;
+}
+
+static void print_hist(void) {
+  uint8_t cmd, bucket;
+
+  for (cmd = 0; cmd < 4; cmd++) {
+    printf("hist,cmd=%u,blocks=%u", hist_cmd[cmd], (cmd < 2) ? 1 : BENCH_BLOCKS);
+    for (bucket = 0; bucket < HIST_BUCKETS - 1; bucket++)
+      printf(",lt%lu=%u", (unsigned long)HIST_BASE_US << bucket, hist[cmd][bucket]);
+    printf(",ge%lu=%u\n", (unsigned long)HIST_BASE_US << (HIST_BUCKETS - 2), hist[cmd][HIST_BUCKETS - 1]);
+  }
+}
+
+/*
+ * f_write then f_read of FATFS_SIZE bytes with a given buffer size
+ */
+static void bench_fatfs(UINT size) {
+  FIL file;
+  FRESULT fr;
+  UINT count;
+  uint32_t done, start, ms;
+
+  memset(buffer, 0x5A, size);
+  if ((fr = f_open(&file, FATFS_FILE, FA_WRITE | FA_CREATE_ALWAYS)) != FR_OK) {
+    printf("error,test=fatfs_open,code=%u\n", fr);
+    return;
+  }
+  start = timer_millis();
+  for (done = 0; done < FATFS_SIZE; done += count)
+    if ((fr = f_write(&file, buffer, size, &count)) != FR_OK || count != size)
+      break;
+  ms = timer_millis() - start;
+  f_close(&file);
+  printf("fatfs,op=write,buf=%u,bytes=%lu,ms=%lu,bps=%lu\n", size, (unsigned long)done,
+	 (unsigned long)ms, (unsigned long)(ms ? (uint64_t)done * 1000 / ms : 0));
+
+  if (f_open(&file, FATFS_FILE, FA_READ) != FR_OK)
+    return;
+  start = timer_millis();
+  for (done = 0; done < FATFS_SIZE; done += count)
+    if ((fr = f_read(&file, buffer, size, &count)) != FR_OK || count == 0)
+      break;
+  ms = timer_millis() - start;
+  f_close(&file);
+  printf("fatfs,op=read,buf=%u,bytes=%lu,ms=%lu,bps=%lu\n", size, (unsigned long)done,
+	 (unsigned long)ms, (unsigned long)(ms ? (uint64_t)done * 1000 / ms : 0));
+}
+
+int main(void) {
+  static FATFS fs;
+  FIL area;
+  FRESULT fr;
+  LBA_t lba;
+  uint8_t i, max_divisor, res;
+  UINT size;
+
+  uart_init(BAUD);
+  uart_console();
+  _delay_ms(1000);
+  timer_clock_start();
+  sei();      /* the benchmarks time long transfers, the clock runs on its interrupt */
+
+  printf("\ninfo,program=sd-bench,f_cpu=%lu,blocks=%u,area=%u\n", (unsigned long)F_CPU, BENCH_BLOCKS, BENCH_AREA);
+  if ((fr = f_mount(&fs, "", 1)) != FR_OK) {
+    printf("error,test=mount,code=%u\n", fr);
+    return 1;
+  }
+  printf("info,type=%u,sectors=%lu,khz=%u,init_ms=%u\n", sd_type(), sd_sector_count(), sd_clock_khz(), sd_init_time());
+
+  /* contiguous test area */
+  if ((fr = f_open(&area, BENCH_FILE, FA_WRITE | FA_CREATE_ALWAYS)) != FR_OK ||
+      (fr = f_expand(&area, (FSIZE_t)BENCH_AREA * SD_BLOCK_SIZE, 1)) != FR_OK) {
+    printf("error,test=expand,code=%u\n", fr);
+    return 1;
+  }
+  lba = fs.database + (LBA_t)fs.csize * (area.obj.sclust - 2);
+  f_close(&area);
+  printf("info,area_lba=%lu\n", (unsigned long)lba);
+
+  /* the fastest divisor is the one negotiated from the CSD, don't go beyond the card:
+   * it is measured first (with the latency histogram, it may not be in divisors[],
+   * e.g. 6 on the MSPIM backend), then the slower ones
+   * the card device settings are changed, sd_select() applies them to the bus */
+  max_divisor = sd_spi.divisor;
+  res = bench_raw(lba, max_divisor, 1);
+  for (i = 0; i < sizeof(divisors) && res == SD_SUCCESS; i++) {
+    if (divisors[i] <= max_divisor)
+      continue;
+    sd_spi.divisor = divisors[i];
+    res = bench_raw(lba, divisors[i], 0);
+  }
+  sd_spi.divisor = max_divisor;
+  print_hist();
+
+  for (size = 64; size <= sizeof(buffer); size <<= 1)
+    bench_fatfs(size);
+
+  f_unlink(FATFS_FILE);
+  f_unlink(BENCH_FILE);
+  f_unmount("");
+  printf("end\n");
+  return 0;                 /* the AVR halts, the host build exits */
+}
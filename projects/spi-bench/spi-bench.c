@@ -0,0 +1,179 @@
+/*
+ * SPI backend benchmark
+ * measures the bytes/second and cpu cycles per byte of the spi library for the
+ * SD card block read and for the SSD1680 clear (4000 bytes of 0xFF), build it
+ * once with the SPDR backend and once with SPI_BACKEND=mspim to compare the two
+ * the SPDR build also times the inline versions of spi.h (SPI_INLINE)
+ *
+ * the timer library counts cpu cycles on 16 bits (4ms at 16MHz) so every
+ * measure is done on a chunk short enough not to overflow and accumulated
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/delay.h>
+#include <uart-mega.h>
+#if !defined(SPI_USE_MSPIM)
+#define SPI_INLINE
+#endif
+#include <spi.h>
+#include <sdcard.h>
+#include <timer.h>
+
+#define SD_BLOCKS         64      /* blocks read for the sd_read() measure */
+#define SD_FIRST_BLOCK  1024      /* far from the FAT structures, content doesn't matter */
+#define CLEAR_SIZE      4000      /* SSD1680_BUFFER_SIZE: 16 bytes * 250 lines */
+#define CHUNK_SIZE       250      /* bytes per timed chunk */
+#define CLEAR_SPEED     8000      /* kHz, same as the SSD1680 driver (F_CPU/2) */
+
+#if defined(SPI_USE_MSPIM)
+#define BACKEND "MSPIM"
+#else
+#define BACKEND "SPDR"
+#endif
+
+static uint8_t buffer[SD_BLOCK_SIZE];
+
+/*
+ * Print a throughput line
+ * bytes: bytes transferred
+ * cycles: cpu cycles spent
+ */
+static void print_rate(const char *label, uint32_t bytes, uint32_t cycles) {
+  uint32_t tenths = cycles * 10 / bytes;
+
+  printf("%-24s %6lu bytes %8lu cycles %7lu bytes/s %3lu.%lu cycles/byte\n", label,
+	 (unsigned long)bytes, (unsigned long)cycles,
+	 (unsigned long)((uint64_t)bytes * F_CPU / cycles),
+	 (unsigned long)(tenths / 10), (unsigned long)(tenths % 10));
+}
+
+/*
+ * Time the sd_read() of SD_BLOCKS consecutive blocks, one at a time
+ */
+static void bench_sd_read(void) {
+  uint32_t cycles = 0;
+  uint16_t ticks;
+  uint16_t i;
+
+  for (i = 0; i < SD_BLOCKS; i++) {
+    timer_start();
+    if (sd_read(SD_FIRST_BLOCK + i, buffer) != SD_SUCCESS) {
+      timer_stop();
+      printf("sd_read error at block %u\n", SD_FIRST_BLOCK + i);
+      return;
+    }
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("sd_read()", (uint32_t)SD_BLOCKS * SD_BLOCK_SIZE, cycles);
+}
+
+/*
+ * Time the SSD1680 clear traffic, byte by byte as the driver did, with
+ * spi_write_block() and with spi_fill() as the driver does now, then the
+ * 0xFF clocking of a block read (no device needed, MISO is just sampled)
+ */
+static void bench_clear(void) {
+  uint32_t cycles;
+  uint16_t ticks;
+  uint16_t i, j;
+
+  memset(buffer, 0xFF, CHUNK_SIZE);
+  spi_set_frequency_khz(CLEAR_SPEED);
+  spi_cs_low();
+
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    for (j = 0; j < CHUNK_SIZE; j++)
+      spi_transfer(0xFF);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("clear spi_transfer()", CLEAR_SIZE, cycles);
+
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    spi_write_block(buffer, CHUNK_SIZE);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("clear spi_write_block()", CLEAR_SIZE, cycles);
+
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    spi_fill(0xFF, CHUNK_SIZE);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("clear spi_fill()", CLEAR_SIZE, cycles);
+
+#if defined(SPI_INLINE)
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    spi_fill_inline(0xFF, CHUNK_SIZE);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("clear spi_fill_inline()", CLEAR_SIZE, cycles);
+#endif
+  spi_cs_high();
+
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    for (j = 0; j < CHUNK_SIZE; j++)
+      buffer[j] = spi_transfer(0xFF);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("read spi_transfer()", CLEAR_SIZE, cycles);
+
+  cycles = 0;
+  for (i = 0; i < CLEAR_SIZE; i += CHUNK_SIZE) {
+    timer_start();
+    spi_read_block(buffer, CHUNK_SIZE);
+    ticks = timer_read();
+    timer_stop();
+    cycles += ticks;
+  }
+  print_rate("read spi_read_block()", CLEAR_SIZE, cycles);
+}
+
+int main(void) {
+  uint8_t res;
+
+  uart_init(BAUD);
+  uart_console();
+  _delay_ms(1000);
+
+  printf("\nSPI benchmark - %s backend @ %luHz\n", BACKEND, (unsigned long)F_CPU);
+
+  if ((res = sd_init()) != SD_SUCCESS) {
+    printf("sd_init error 0x%02X\n", res);
+  } else {
+    printf("SD clock: %u kHz\n", sd_clock_khz());
+    if (sd_clock_khz() < 2000)
+      printf("warning: clock too slow, a block read overflows the 16 bit timer\n");
+    bench_sd_read();
+  }
+
+  /* the clear is only clocked out, no display is needed to measure it */
+  bench_clear();
+
+  for (;;)
+    ;
+  return 0;
+}